@@ -0,0 +1,198 @@
+#include <string>
+#include <vector>
+#include <thread>
+#include <stdexcept>
+#include <algorithm>
+#include <cstring>
+
+#include "include/BedReader.h"
+
+using std::string;
+using std::vector;
+
+
+// Open the file, tell BGZF from other files by the "BC" field of the first
+// gzip header. Use 'threads' threads for BGZF (all cores if 0).
+BedReader::BedReader(const string &fname, unsigned threads)
+: fname_(fname), threads_(threads), bgzf_(NULL), gz_(NULL), data_pos_(0),
+eof_(false)
+{
+    if (threads_ == 0) threads_ = std::thread::hardware_concurrency();
+    if (threads_ == 0) threads_ = 1;
+    FILE* file = fopen(fname.c_str(), "rb");
+    if (file == NULL) throw std::runtime_error("Unreadable file " + fname);
+    unsigned char header[14];
+    bool is_bgzf = (fread(header, 1, 14, file) == 14) &&
+                   (header[0] == 0x1f) && (header[1] == 0x8b) &&
+                   (header[2] == 8) && (header[3] & 4) &&
+                   (header[12] == 'B') && (header[13] == 'C');
+    if (is_bgzf)
+    {
+        rewind(file);
+        bgzf_ = file;
+        return;
+    }
+    fclose(file);
+    // zlib reads plain files as they are
+    gz_ = gzopen(fname.c_str(), "rb");
+    if (gz_ == NULL) throw std::runtime_error("Unreadable file " + fname);
+    gzbuffer(gz_, BED_CHUNK_SIZE);
+}
+
+BedReader::~BedReader()
+{
+    if (bgzf_ != NULL) fclose(bgzf_);
+    if (gz_ != NULL) gzclose(gz_);
+}
+
+// Get the next line without its end, return false at the end of the file
+bool BedReader::get_line(string &line)
+{
+    while (true)
+    {
+        char* begin = data_.data() + data_pos_;
+        char* newline = NULL;
+        if (data_pos_ < data_.size())
+            newline = (char*)memchr(begin, '\n', data_.size() - data_pos_);
+        if (newline != NULL)
+        {
+            line.assign(begin, newline);
+            data_pos_ = newline + 1 - data_.data();
+            return true;
+        }
+        if (!fill())
+        {
+            if (data_pos_ == data_.size()) return false;
+            // The last line has no end
+            line.assign(data_.begin() + data_pos_, data_.end());
+            data_pos_ = data_.size();
+            return true;
+        }
+    }
+}
+
+// Append more inflated bytes to the unread ones, return false if there are
+// none left
+bool BedReader::fill()
+{
+    if (eof_) return false;
+    data_.erase(data_.begin(), data_.begin() + data_pos_);
+    data_pos_ = 0;
+    size_t old_size = data_.size();
+    if (gz_ != NULL)
+    {
+        data_.resize(old_size + BED_CHUNK_SIZE);
+        int read = gzread(gz_, data_.data() + old_size, BED_CHUNK_SIZE);
+        if (read < 0) throw std::runtime_error("Corrupted file " + fname_);
+        data_.resize(old_size + read);
+        if (read == 0) eof_ = true;
+        return read > 0;
+    }
+
+    // Read a batch of BGZF blocks and let each thread inflate every
+    // threads_-th of them
+    vector<string> blocks, inflated;
+    string block;
+    while ((blocks.size() < threads_ * BED_BLOCKS_PER_THREAD) &&
+           read_block(block))
+    {
+        blocks.push_back(block);
+    }
+    if (blocks.empty())
+    {
+        eof_ = true;
+        return false;
+    }
+    inflated.resize(blocks.size());
+    vector<std::thread> workers;
+    vector<string> errors(threads_);
+    unsigned thread_count = std::min<size_t>(threads_, blocks.size());
+    for (unsigned t = 0; t < thread_count; ++t)
+    {
+        workers.push_back(std::thread([&, t]()
+        {
+            try
+            {
+                for (size_t i = t; i < blocks.size(); i += thread_count)
+                    inflate_block(blocks[i], inflated[i]);
+            }
+            catch (std::runtime_error &e)
+            {
+                errors[t] = e.what();
+            }
+        }));
+    }
+    for (auto it = workers.begin(); it != workers.end(); ++it) it->join();
+    for (auto it = errors.begin(); it != errors.end(); ++it)
+    {
+        if (!it->empty()) throw std::runtime_error(*it);
+    }
+    for (auto it = inflated.begin(); it != inflated.end(); ++it)
+        data_.insert(data_.end(), it->begin(), it->end());
+    return true;
+}
+
+// Read the next whole BGZF block, return false at the end of the file
+bool BedReader::read_block(string &block)
+{
+    unsigned char header[12];
+    size_t read = fread(header, 1, 12, bgzf_);
+    if (read == 0) return false;
+    if ((read != 12) || (header[0] != 0x1f) || (header[1] != 0x8b) ||
+        !(header[3] & 4))
+    {
+        throw std::runtime_error("Corrupted BGZF file " + fname_);
+    }
+    size_t extra_length = header[10] | (header[11] << 8);
+    string extra(extra_length, '\0');
+    if (fread(&extra[0], 1, extra_length, bgzf_) != extra_length)
+        throw std::runtime_error("Corrupted BGZF file " + fname_);
+    // Find the total size of the block in the "BC" subfield
+    size_t block_size = 0;
+    for (size_t i = 0; i + 4 <= extra_length; )
+    {
+        size_t field_length = (unsigned char)extra[i+2] |
+                              ((unsigned char)extra[i+3] << 8);
+        if ((extra[i] == 'B') && (extra[i+1] == 'C') && (field_length == 2) &&
+            (i + 6 <= extra_length))
+        {
+            block_size = ((unsigned char)extra[i+4] |
+                          ((unsigned char)extra[i+5] << 8)) + 1;
+        }
+        i += 4 + field_length;
+    }
+    if (block_size < 12 + extra_length + 8)
+        throw std::runtime_error("Corrupted BGZF file " + fname_);
+    block.resize(block_size - 12 - extra_length);
+    if (fread(&block[0], 1, block.size(), bgzf_) != block.size())
+        throw std::runtime_error("Corrupted BGZF file " + fname_);
+    return true;
+}
+
+// Inflate compressed data of a BGZF block followed by its CRC32 and size
+void BedReader::inflate_block(const string &block, string &out)
+{
+    const unsigned char* trailer =
+        (const unsigned char*)block.data() + block.size() - 8;
+    uint32_t crc = trailer[0] | (trailer[1] << 8) | (trailer[2] << 16) |
+                   ((uint32_t)trailer[3] << 24);
+    uint32_t size = trailer[4] | (trailer[5] << 8) | (trailer[6] << 16) |
+                    ((uint32_t)trailer[7] << 24);
+    out.resize(size);
+    if (size == 0) return;
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    if (inflateInit2(&stream, -15) != Z_OK)
+        throw std::runtime_error("Can not inflate " + fname_);
+    stream.next_in = (Bytef*)block.data();
+    stream.avail_in = block.size() - 8;
+    stream.next_out = (Bytef*)&out[0];
+    stream.avail_out = size;
+    int status = inflate(&stream, Z_FINISH);
+    inflateEnd(&stream);
+    if ((status != Z_STREAM_END) || (stream.avail_out != 0) ||
+        (crc32(crc32(0, NULL, 0), (const Bytef*)out.data(), size) != crc))
+    {
+        throw std::runtime_error("Corrupted BGZF file " + fname_);
+    }
+}
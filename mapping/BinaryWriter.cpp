@@ -0,0 +1,88 @@
+#include <map>
+#include <string>
+#include <vector>
+#include <ostream>
+#include <stdexcept>
+
+#include "include/BinaryWriter.h"
+
+using std::map;
+using std::string;
+using std::vector;
+using std::pair;
+
+
+// Write the tables of informant chromosomes and error names
+BinaryWriter::BinaryWriter(std::ostream &out,
+                           map<string, pair <bioid_t, seqpos_t> > &chr_map,
+                           const vector<string> &error_names)
+: out_(out), chr_map_(chr_map)
+{
+    out_.write(MAPPED_MAGIC, sizeof(MAPPED_MAGIC));
+    write_number(MAPPED_VERSION);
+    write_number(chr_map_.size());
+    for (auto it = chr_map_.begin(); it != chr_map_.end(); ++it)
+    {
+        write_number(it->second.first);
+        write_string(it->first);
+    }
+    write_number(error_names.size());
+    for (auto it = error_names.begin(); it != error_names.end(); ++it)
+        write_string(*it);
+}
+
+// Write record of a mapped line, 'answer' must be half-closed
+void BinaryWriter::write_answer(uint64_t line, unsigned config,
+                                BedQuery* answer)
+{
+    MappedRecord record = MappedRecord();
+    record.line = line;
+    record.start = answer->get_start();
+    record.end = answer->get_end();
+    record.thick_start = answer->get_thick_start();
+    record.thick_end = answer->get_thick_end();
+    auto chr = chr_map_.find(answer->get_chr());
+    if (chr == chr_map_.end())
+        throw std::runtime_error("Unknown chromosome " + answer->get_chr());
+    record.chr_id = chr->second.first;
+    record.exon_count = answer->get_exon_count();
+    record.config = config;
+    record.strand = answer->get_strand();
+    vector<int64_t> exons;
+    for (unsigned i = 0; i < record.exon_count; ++i)
+    {
+        int64_t start = (*answer->get_exon_starts())[i];
+        int64_t length = (*answer->get_exon_ends())[i] - start;
+        exons.push_back(mapped_order(start));
+        exons.push_back(mapped_order(length));
+    }
+    mapped_order(record);
+    out_.write((const char*)&record, sizeof(record));
+    if (!exons.empty())
+        out_.write((const char*)&exons[0], exons.size() * sizeof(int64_t));
+}
+
+// Write record of a line which failed with the given error code
+void BinaryWriter::write_error(uint64_t line, unsigned config, uint8_t error)
+{
+    MappedRecord record = MappedRecord();
+    record.line = line;
+    record.thick_start = -1;
+    record.thick_end = -1;
+    record.config = config;
+    record.error = error;
+    mapped_order(record);
+    out_.write((const char*)&record, sizeof(record));
+}
+
+void BinaryWriter::write_number(uint32_t number)
+{
+    number = mapped_order(number);
+    out_.write((const char*)&number, sizeof(number));
+}
+
+void BinaryWriter::write_string(const string &s)
+{
+    write_number(s.size());
+    out_.write(s.data(), s.size());
+}
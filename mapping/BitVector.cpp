@@ -0,0 +1,254 @@
+#include <vector>
+#include <cstdint>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BITVECTOR_X86
+#endif
+
+#include "include/BitVector.h"
+
+using std::vector;
+
+
+void BitVector::push_back(bool bit)
+{
+    if ((size_ >> 6) + PADDING_WORDS + 1 >= (int64_t)words_.size())
+        words_.resize(words_.size() * 2, 0);
+    if (bit) set(size_);
+    ++size_;
+}
+
+int64_t BitVector::size() const
+{
+    return size_;
+}
+
+uint64_t* BitVector::words()
+{
+    return &words_[0];
+}
+
+int64_t BitVector::word_count() const
+{
+    return (size_ + 63) / 64;
+}
+
+// Bytes taken by the vector
+uint64_t BitVector::memory_usage() const
+{
+    return sizeof(BitVector) + words_.capacity() * sizeof(uint64_t);
+}
+
+// Set positions from .. to-1 to '1'
+void BitVector::set_range(int64_t from, int64_t to)
+{
+    while (from < to)
+    {
+        int64_t bits = 64 - (from & 63);
+        if (to - from < bits) bits = to - from;
+        uint64_t mask = ~(uint64_t)0;
+        if (bits < 64) mask = ((uint64_t)1 << bits) - 1;
+        set_bits(from, mask);
+        from += bits;
+    }
+}
+
+// Read 64 bits starting at bit i
+uint64_t BitVector::get_word(int64_t i) const
+{
+    int64_t w = i >> 6;
+    int s = i & 63;
+    if (s == 0) return words_[w];
+    return (words_[w] >> s) | (words_[w+1] << (64 - s));
+}
+
+// Read 64 bits ending at bit i (bit i becomes the highest one); bits before
+// the beginning are zero
+uint64_t BitVector::get_word_ending(int64_t i) const
+{
+    if (i >= 63) return get_word(i - 63);
+    return get_word(0) << (63 - i);
+}
+
+// Count '1's at positions from .. to-1
+int64_t BitVector::count(int64_t from, int64_t to) const
+{
+    int64_t ones = 0;
+    for (; from + 64 <= to; from += 64)
+        ones += __builtin_popcountll(get_word(from));
+    if (from < to)
+    {
+        ones += __builtin_popcountll(get_word(from) &
+                                     (((uint64_t)1 << (to - from)) - 1));
+    }
+    return ones;
+}
+
+// Test whether any of 'BLOCK' consecutive positions from ja in 'a' and from
+// jb in 'b' is '1' in both. Variants use the widest vectors the CPU has.
+namespace
+{
+    typedef bool (*block_test_t)(const uint64_t* a, int64_t ja,
+                                 const uint64_t* b, int64_t jb);
+
+    inline uint64_t shifted_word(const uint64_t* w, int64_t i)
+    {
+        int s = i & 63;
+        if (s == 0) return w[i >> 6];
+        return (w[i >> 6] >> s) | (w[(i >> 6) + 1] << (64 - s));
+    }
+
+    bool any_aligned_scalar(const uint64_t* a, int64_t ja,
+                            const uint64_t* b, int64_t jb)
+    {
+        uint64_t x = 0;
+        for (int i = 0; i < 256; i += 64)
+            x |= shifted_word(a, ja + i) & shifted_word(b, jb + i);
+        return x != 0;
+    }
+
+#ifdef BITVECTOR_X86
+    __attribute__((target("avx2")))
+    inline __m256i shifted_256(const uint64_t* w, int64_t i)
+    {
+        __m256i lo = _mm256_loadu_si256((const __m256i*)(w + (i >> 6)));
+        __m256i hi = _mm256_loadu_si256((const __m256i*)(w + (i >> 6) + 1));
+        // Shifting by 64 gives zero, so no special case for i % 64 == 0
+        return _mm256_or_si256(
+            _mm256_srlv_epi64(lo, _mm256_set1_epi64x(i & 63)),
+            _mm256_sllv_epi64(hi, _mm256_set1_epi64x(64 - (i & 63))));
+    }
+
+    __attribute__((target("avx2")))
+    bool any_aligned_avx2(const uint64_t* a, int64_t ja,
+                          const uint64_t* b, int64_t jb)
+    {
+        return !_mm256_testz_si256(shifted_256(a, ja), shifted_256(b, jb));
+    }
+
+    __attribute__((target("avx512f")))
+    inline __m512i shifted_512(const uint64_t* w, int64_t i)
+    {
+        __m512i lo = _mm512_loadu_si512((const void*)(w + (i >> 6)));
+        __m512i hi = _mm512_loadu_si512((const void*)(w + (i >> 6) + 1));
+        __m512i shift = _mm512_set1_epi64(i & 63);
+        __m512i back_shift = _mm512_set1_epi64(64 - (i & 63));
+        // Zero-masking forms avoid reading an undefined pass-through operand
+        return _mm512_or_si512(_mm512_maskz_srlv_epi64(0xff, lo, shift),
+                               _mm512_maskz_sllv_epi64(0xff, hi, back_shift));
+    }
+
+    __attribute__((target("avx512f")))
+    bool any_aligned_avx512(const uint64_t* a, int64_t ja,
+                            const uint64_t* b, int64_t jb)
+    {
+        return _mm512_test_epi64_mask(shifted_512(a, ja),
+                                      shifted_512(b, jb)) != 0;
+    }
+#endif
+
+    struct BlockTest
+    {
+        block_test_t test;
+        int64_t width;
+
+        BlockTest(): test(any_aligned_scalar), width(256)
+        {
+#ifdef BITVECTOR_X86
+            __builtin_cpu_init();
+            if (__builtin_cpu_supports("avx512f"))
+            {
+                test = any_aligned_avx512;
+                width = 512;
+            }
+            else if (__builtin_cpu_supports("avx2"))
+            {
+                test = any_aligned_avx2;
+            }
+#endif
+        }
+    };
+
+    const BlockTest& block_test()
+    {
+        static BlockTest chosen;
+        return chosen;
+    }
+}
+
+// Find the first k < count such that a[ja + way*k] and b[jb + way*k] are
+// both '1', return count if there is none. Positions walked must be
+// inside both vectors. Instantiated for both directions, so that the inner
+// loop does not test 'way'.
+template <int way>
+int64_t BitVector::find_aligned(const BitVector &a, int64_t ja,
+                                const BitVector &b, int64_t jb,
+                                int64_t count)
+{
+    const BlockTest &block = block_test();
+    const uint64_t *aw = &a.words_[0], *bw = &b.words_[0];
+    int64_t k = 0;
+    while (k < count)
+    {
+        // Skip whole blocks without any aligned position
+        if (count - k >= block.width)
+        {
+            bool any;
+            if (way == 1) any = block.test(aw, ja + k, bw, jb + k);
+            else any = block.test(aw, ja - k - block.width + 1,
+                                  bw, jb - k - block.width + 1);
+            if (!any)
+            {
+                k += block.width;
+                continue;
+            }
+        }
+        int64_t end = count;
+        if (k + block.width < end) end = k + block.width;
+        for (; k < end; k += 64)
+        {
+            uint64_t x;
+            if (way == 1)
+            {
+                x = a.get_word(ja + k) & b.get_word(jb + k);
+                if (end - k < 64) x &= ((uint64_t)1 << (end - k)) - 1;
+                if (x != 0) return k + __builtin_ctzll(x);
+            }
+            else
+            {
+                x = a.get_word_ending(ja - k) & b.get_word_ending(jb - k);
+                if (end - k < 64) x &= ~(((uint64_t)1 << (64 - end + k)) - 1);
+                if (x != 0) return k + __builtin_clzll(x);
+            }
+        }
+    }
+    return count;
+}
+
+template int64_t BitVector::find_aligned<1>(const BitVector &a, int64_t ja,
+                                            const BitVector &b, int64_t jb,
+                                            int64_t count);
+template int64_t BitVector::find_aligned<-1>(const BitVector &a, int64_t ja,
+                                             const BitVector &b, int64_t jb,
+                                             int64_t count);
+
+// Get number of consecutive positions (at most count) from ja in 'a' and
+// from jb in 'b' which are '1' in both
+int64_t BitVector::aligned_run(const BitVector &a, int64_t ja,
+                               const BitVector &b, int64_t jb, int64_t count)
+{
+    int64_t k = 0;
+    while (k < count)
+    {
+        uint64_t x = ~(a.get_word(ja + k) & b.get_word(jb + k));
+        if (x != 0)
+        {
+            k += __builtin_ctzll(x);
+            break;
+        }
+        k += 64;
+    }
+    if (k > count) k = count;
+    return k;
+}
@@ -0,0 +1,162 @@
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <future>
+#include <exception>
+
+#include "include/BlockCache.h"
+
+using std::vector;
+
+
+// Keep about 'capacity' unpinned blocks in at most 'max_shards' shards
+BlockCache::BlockCache(unsigned capacity, unsigned max_shards)
+: shards_(count_shards(capacity, max_shards)), clock_(0), bytes_(0),
+peak_bytes_(0)
+{
+    shard_capacity_ = (capacity + shards_.size() - 1) / shards_.size();
+    if (shard_capacity_ == 0) shard_capacity_ = 1;
+}
+
+// Number of shards with at least BLOCK_CACHE_SHARD_BLOCKS blocks each
+unsigned BlockCache::count_shards(unsigned capacity, unsigned max_shards)
+{
+    unsigned count = capacity / BLOCK_CACHE_SHARD_BLOCKS;
+    if (count > max_shards) count = max_shards;
+    return (count == 0) ? 1 : count;
+}
+
+BlockCache::Shard &BlockCache::shard_of(const BlockKey &key)
+{
+    uint64_t h = (key.second * 0x9e3779b97f4a7c15ULL) ^ key.first;
+    h ^= h >> 29;
+    return shards_[h % shards_.size()];
+}
+
+// Return the cached block, or an empty handle if it is not cached
+ReferenceHandle BlockCache::find(const BlockKey &key)
+{
+    Shard &shard = shard_of(key);
+    std::lock_guard<std::mutex> guard(shard.lock);
+    auto it = shard.entries.find(key);
+    if (it == shard.entries.end()) return ReferenceHandle();
+    it->second.last_use = ++clock_;
+    return it->second.reference;
+}
+
+// Return the block, decoding it by 'load' if it is neither cached nor
+// decoded by another thread. Blocks evicted to make room are appended to
+// 'evicted', so that the caller can drop what it built over them before
+// they are freed.
+ReferenceHandle BlockCache::get(const BlockKey &key,
+                                const std::function<Reference*()> &load,
+                                vector<ReferenceHandle> &evicted)
+{
+    Shard &shard = shard_of(key);
+    std::unique_lock<std::mutex> guard(shard.lock);
+    auto it = shard.entries.find(key);
+    if (it != shard.entries.end())
+    {
+        it->second.last_use = ++clock_;
+        return it->second.reference;
+    }
+    auto loading = shard.loading.find(key);
+    if (loading != shard.loading.end())
+    {
+        std::shared_future<ReferenceHandle> result = loading->second;
+        guard.unlock();
+        return result.get();
+    }
+    std::promise<ReferenceHandle> promise;
+    shard.loading[key] = promise.get_future().share();
+    guard.unlock();
+
+    ReferenceHandle reference;
+    try
+    {
+        reference = ReferenceHandle(load());
+    }
+    catch (...)
+    {
+        // Let the waiting threads fail the same way
+        guard.lock();
+        shard.loading.erase(key);
+        guard.unlock();
+        promise.set_exception(std::current_exception());
+        throw;
+    }
+    guard.lock();
+    insert(shard, key, reference, evicted);
+    shard.loading.erase(key);
+    guard.unlock();
+    promise.set_value(reference);
+    return reference;
+}
+
+// Add the block to the locked shard, evicting its least recently used
+// unpinned blocks over its capacity
+void BlockCache::insert(Shard &shard, const BlockKey &key,
+                        const ReferenceHandle &reference,
+                        vector<ReferenceHandle> &evicted)
+{
+    Entry entry = {reference, ++clock_, reference->memory_usage()};
+    shard.entries[key] = entry;
+    uint64_t bytes = (bytes_ += entry.bytes);
+    uint64_t peak = peak_bytes_;
+    while ((bytes > peak) && !peak_bytes_.compare_exchange_weak(peak, bytes));
+    while (shard.entries.size() > shard_capacity_)
+    {
+        auto oldest = shard.entries.end();
+        for (auto it = shard.entries.begin(); it != shard.entries.end(); ++it)
+        {
+            // The cache holds one handle, the block being added one more
+            if ((it->first == key) || (it->second.reference.use_count() > 1))
+                continue;
+            if ((oldest == shard.entries.end()) ||
+                (it->second.last_use < oldest->second.last_use))
+            {
+                oldest = it;
+            }
+        }
+        if (oldest == shard.entries.end()) break;
+        evicted.push_back(oldest->second.reference);
+        bytes_ -= oldest->second.bytes;
+        shard.entries.erase(oldest);
+    }
+}
+
+// Number of cached blocks
+uint64_t BlockCache::size()
+{
+    uint64_t count = 0;
+    for (auto it = shards_.begin(); it != shards_.end(); ++it)
+    {
+        std::lock_guard<std::mutex> guard(it->lock);
+        count += it->entries.size();
+    }
+    return count;
+}
+
+// Bytes taken by the cached blocks as they are now, with segments built
+// since they were added
+uint64_t BlockCache::memory_usage()
+{
+    uint64_t bytes = 0;
+    for (auto it = shards_.begin(); it != shards_.end(); ++it)
+    {
+        std::lock_guard<std::mutex> guard(it->lock);
+        for (auto entry = it->entries.begin(); entry != it->entries.end();
+             ++entry)
+        {
+            bytes += entry->second.reference->memory_usage();
+        }
+    }
+    return bytes;
+}
+
+// Most bytes taken by the cached blocks at once, measured when added
+uint64_t BlockCache::get_peak_bytes()
+{
+    return peak_bytes_;
+}
@@ -1,6 +1,7 @@
 #include <istream>
 #include <fstream>
 #include <map>
+#include <algorithm>
 #include <string>
 #include <vector>
 #include <utility>
@@ -8,7 +9,12 @@
 #include <ios>
 #include <ostream>
 #include <stdexcept>
+#include <sstream>
 #include <cstring>
+#include <cstdio>
+#include <thread>
+#include <limits>
+#include <set>
 
 #include <iomanip>
 
@@ -29,7 +35,7 @@ using std::make_pair;
 
 IOHandler::IOHandler(char header_fname[], char bin_fname[], bool compressed,
                      char maf_fname[]):
-    compressed_(compressed)
+    compressed_(compressed), cache_(max_cache_size_)
 {
     strcpy(header_fname_, header_fname);
     strcpy(bin_fname_, bin_fname);
@@ -39,30 +45,53 @@ IOHandler::IOHandler(char header_fname[], char bin_fname[], bool compressed,
     if (maf_fname_[0] == '\0') map_ = true;
     else preprocess_ = true;
     map_opened_ = false;
+    format_version_ = FORMAT_V1;
+    has_coverage_ = false;
+    has_summaries_ = false;
+    pool_ = NULL;
+    owns_pool_ = true;
+    threads_ = 1;
+    header_bytes_ = 0;
+    record_pos_ = 0;
+    shard_fnames_.push_back(bin_fname_);
+    shard_sources_.push_back(NULL);
+    shard_ = 0;
+    source_ = NULL;
+    is_projection_ = false;
+    bgzf_ = NULL;
 }
 
 IOHandler::~IOHandler()
 {
-    if (map_opened_)
+    for (auto it = shard_sources_.begin(); it != shard_sources_.end(); ++it)
+        delete *it;
+    for (auto it = readers_.begin(); it != readers_.end(); ++it) delete *it;
+    if (owns_pool_) delete pool_;
+    if (map_opened_ && preprocess_)
     {
         if (compressed_) bgzf_close(bgzf_);
-        else ibin_.close();
+        else obin_.close();
     }
-    for (auto it = cache_.begin(); it != cache_.end(); ++it)
+    for (auto it = informant_arrays_.begin(); it != informant_arrays_.end();
+         ++it)
     {
-        delete it->second.first;
+        delete it->second;
+    }
+    for (auto it = coverage_.begin(); it != coverage_.end(); ++it)
+    {
+        delete it->second;
     }
 }
 
-// Opens the BGZF or BIN file with preprocessed alignments or an empty file
+// Opens the BGZF or BIN file with preprocessed alignments or an empty file,
+// shards of a sharded store are opened when first read
 void IOHandler::open_to_map()
 {
     try
     {
-        if (map_)
+        if (map_ && chr_shards_.empty())
         {
-            if (compressed_) bgzf_ = bgzf_open(bin_fname_, "r");
-            else ibin_.open(bin_fname_, std::ios::in | std::ios::binary);
+            select_shard(0);
         }
         if (preprocess_)
         {
@@ -78,19 +107,54 @@ void IOHandler::open_to_map()
     map_opened_ = true;
 }
 
+// Return number stored big-endian in 'size' bytes of 'data'
+// 'size' must be <= 8
+uint64_t IOHandler::decode_number(const char data[], const int size)
+{
+    uint32_t word;
+    uint64_t number;
+    switch (size)
+    {
+        case 1:
+            return (uint8_t)data[0];
+        case 2:
+            return ((uint64_t)(uint8_t)data[0] << 8) | (uint8_t)data[1];
+        case 4:
+            memcpy(&word, data, 4);
+            return __builtin_bswap32(word);
+        case 8:
+            memcpy(&number, data, 8);
+            return __builtin_bswap64(number);
+    }
+    number = 0;
+    for (int i = 0; i < size; ++i)
+    {
+        number <<= 8;
+        number += (uint8_t)data[i];
+    }
+    return number;
+}
+
 // Read 'size' bytes and returns number represented by those bytes
 // 'size' must be <= 8
 uint64_t IOHandler::bytes_to_number(istream &s, const int size)
 {
-    uint64_t number = 0;
     char data[8] = {0, 0, 0, 0, 0, 0, 0, 0};
     s.read(data, size);
-    for (int i = 0; i < size; ++i)
+    return decode_number(data, size);
+}
+
+// Chromosome length read from a header, which must fit coordinates of this
+// build
+seqpos_t IOHandler::to_chr_length(uint64_t length)
+{
+    if (length > (uint64_t)std::numeric_limits<seqpos_t>::max())
     {
-        number <<= 8;
-        number += (unsigned uint8_t)data[i];
+        throw std::runtime_error("Chromosome length " +
+            std::to_string(length) + " does not fit coordinates of this " +
+            "build, rebuild maptool without COORD32");
     }
-    return number;
+    return length;
 }
 
 // Read information from header into given structures
@@ -102,11 +166,35 @@ void IOHandler::read_header(map <string, bioid_t> &genome_map,
     s.unsetf(std::ios::skipws);
     s.exceptions(istream::failbit | istream::badbit);
     
+    // Headers of newer formats start with a zero byte, which can not be
+    // a genome count. A projection holds its records and then its header.
+    if (is_projection(header_fname_))
+    {
+        s.seekg(FORMAT_MAGIC_SIZE);
+        s.seekg(bytes_to_number(s, PROJECTION_OFFSET_SIZE));
+        read_header_v2(s, genome_map, chr_maps, index);
+        s.close();
+        is_projection_ = true;
+        compressed_ = false;
+        shard_fnames_[0] = header_fname_;
+        header_bytes_ = count_header_bytes(genome_map, chr_maps, index);
+        return;
+    }
+    if (s.peek() == 0)
+    {
+        read_header_v2(s, genome_map, chr_maps, index);
+        s.close();
+        if (map_) read_manifest(chr_maps[0]);
+        header_bytes_ = count_header_bytes(genome_map, chr_maps, index);
+        return;
+    }
+    format_version_ = FORMAT_V1;
+    
     // Read into 'genome_map': name and id
     biocount_t genome_count = bytes_to_number(s, OLD_BIOCOUNT_SIZE1);
-    for (int i = 0; i < genome_count; ++i)
+    for (biocount_t i = 0; i < genome_count; ++i)
     {
-        bioid_t name_len = bytes_to_number(s, OLD_BIOID_SIZE1);
+        uint64_t name_len = bytes_to_number(s, OLD_BIOID_SIZE1);
         string name;
         name.resize(name_len);
         s.read(&name[0], name_len);        
@@ -118,16 +206,17 @@ void IOHandler::read_header(map <string, bioid_t> &genome_map,
     // chromosome name and chromosome id
     for (unsigned int i = 0; i < genome_map.size(); ++i)
     {
-        bioid_t chr_count = bytes_to_number(s, OLD_BIOID_SIZE2);
+        biocount_t chr_count = bytes_to_number(s, OLD_BIOID_SIZE2);
         map <string, pair <bioid_t, seqpos_t> > chr_map;
-        for (int j = 0; j < chr_count; ++j)
+        for (biocount_t j = 0; j < chr_count; ++j)
         {
-            bioid_t name_len = bytes_to_number(s, OLD_BIOID_SIZE1);
+            uint64_t name_len = bytes_to_number(s, OLD_BIOID_SIZE1);
             string name;
             name.resize(name_len);
             s.read(&name[0], name_len);            
             bioid_t chr_id = bytes_to_number(s, OLD_BIOID_SIZE2);
-            seqpos_t chr_len = bytes_to_number(s, OLD_SEQPOS_SIZE);
+            seqpos_t chr_len = to_chr_length(bytes_to_number(s,
+                                                             OLD_SEQPOS_SIZE));
             chr_map[name] = make_pair(chr_id, chr_len);
         }
         chr_maps.push_back(chr_map);
@@ -139,9 +228,9 @@ void IOHandler::read_header(map <string, bioid_t> &genome_map,
     for (unsigned int i = 0; i < chr_maps[0].size(); ++i)
     {
         bioid_t chr_id = bytes_to_number(s, OLD_BIOID_SIZE2);
-        bioid_t ref_count = bytes_to_number(s, OLD_BIOCOUNT_SIZE2);
+        uint64_t ref_count = bytes_to_number(s, OLD_BIOCOUNT_SIZE2);
         vector<IndexItem*> chr_index;
-        for (int j = 0; j < ref_count; ++j)
+        for (uint64_t j = 0; j < ref_count; ++j)
         {
             bool strand = bytes_to_number(s, STRAND_SIZE);
             seqpos_t chr_pos = bytes_to_number(s, OLD_SEQPOS_SIZE);
@@ -154,221 +243,1825 @@ void IOHandler::read_header(map <string, bioid_t> &genome_map,
     }
     
     s.close();
+    if (map_) read_manifest(chr_maps[0]);
+    set_record_lengths(index);
+    header_bytes_ = count_header_bytes(genome_map, chr_maps, index);
 }
 
-// Read from BGZF/BIN file 'size' bytes to a number
-uint64_t IOHandler::read_bin_number(const int size)
+// Count bytes taken by the tables read from the header and by the coverage
+// index
+uint64_t IOHandler::count_header_bytes(map <string, bioid_t> &genome_map,
+                                       vector <map <string, pair <bioid_t,
+                                       seqpos_t> > > &chr_maps,
+                                       map <bioid_t, vector <IndexItem*> >
+                                       &index)
+{
+    uint64_t bytes = 0;
+    for (auto it = genome_map.begin(); it != genome_map.end(); ++it)
+        bytes += MAP_NODE_SIZE + sizeof(*it) + it->first.capacity();
+    for (auto it = chr_maps.begin(); it != chr_maps.end(); ++it)
+    {
+        bytes += sizeof(*it);
+        for (auto chr = it->begin(); chr != it->end(); ++chr)
+            bytes += MAP_NODE_SIZE + sizeof(*chr) + chr->first.capacity();
+    }
+    for (auto it = index.begin(); it != index.end(); ++it)
+    {
+        bytes += MAP_NODE_SIZE + sizeof(*it) +
+                 it->second.capacity() * sizeof(IndexItem*);
+        for (auto item = it->second.begin(); item != it->second.end(); ++item)
+            bytes += (*item)->memory_usage();
+    }
+    for (auto it = coverage_.begin(); it != coverage_.end(); ++it)
+        bytes += MAP_NODE_SIZE + sizeof(*it) + it->second->memory_usage();
+    return bytes;
+}
+
+// Whether the file is a pairwise projection written by "extract"
+bool IOHandler::is_projection(const char fname[])
+{
+    char magic[FORMAT_MAGIC_SIZE];
+    ifstream s(fname, std::ios::in | std::ios::binary);
+    s.read(magic, FORMAT_MAGIC_SIZE);
+    return s.good() &&
+           (memcmp(magic, PROJECTION_MAGIC, FORMAT_MAGIC_SIZE) == 0);
+}
+
+// If the BGZF/BIN file is a manifest of a sharded store, read which files
+// hold records of which reference chromosomes. Relative file names are
+// relative to the manifest.
+void IOHandler::read_manifest(map <string, pair <bioid_t, seqpos_t> >
+                              &ref_chr_map)
+{
+    ifstream s(bin_fname_, std::ios::in);
+    string line;
+    if (!getline(s, line) || (line != SHARD_MANIFEST_MAGIC)) return;
+    string dir(bin_fname_);
+    size_t slash = dir.rfind('/');
+    if (slash == string::npos) dir = "";
+    else dir.erase(slash + 1);
+    shard_fnames_.clear();
+    shard_sources_.clear();
+    map <string, int> shards;
+    while (getline(s, line))
+    {
+        if (line.empty()) continue;
+        size_t tab = line.find('\t');
+        string chr_name = line.substr(0, tab);
+        if ((tab == string::npos) || (ref_chr_map.count(chr_name) == 0))
+        {
+            throw std::runtime_error("Invalid line in manifest " +
+                                     string(bin_fname_) + ": " + line);
+        }
+        string fname = line.substr(tab + 1);
+        if ((fname[0] != '/') && !dir.empty()) fname = dir + fname;
+        if (shards.count(fname) == 0)
+        {
+            shards[fname] = shard_fnames_.size();
+            shard_fnames_.push_back(fname);
+            shard_sources_.push_back(NULL);
+        }
+        chr_shards_[ref_chr_map[chr_name].first] = shards[fname];
+    }
+    if (chr_shards_.empty())
+        throw std::runtime_error("Empty manifest " + string(bin_fname_));
+}
+
+// Read unsigned varint from the header
+uint64_t IOHandler::read_varint(istream &s)
 {
-    if (!map_) return 0;
     uint64_t number = 0;
-    char data[8] = {0, 0, 0, 0, 0, 0, 0, 0};
-    if (compressed_)
+    for (int shift = 0; shift < 64; shift += 7)
+    {
+        uint8_t byte = bytes_to_number(s, 1);
+        number |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) return number;
+    }
+    throw std::runtime_error("Corrupted varint in " + string(header_fname_));
+}
+
+// Read signed (zigzag encoded) varint
+int64_t IOHandler::read_signed_varint(istream &s)
+{
+    uint64_t number = read_varint(s);
+    return (int64_t)(number >> 1) ^ -(int64_t)(number & 1);
+}
+
+// Read bit vector of the given length written by put_bit_vector
+BitVector* IOHandler::read_bit_vector(istream &s, seqpos_t length)
+{
+    BitVector* bits = new BitVector(length);
+    int encoding = bytes_to_number(s, 1);
+    if (encoding == BITS_RAW)
+    {
+        for (seqpos_t i = 0; i < (length + 7) / 8; ++i)
+            bits->set_bits(8*i, (uint8_t)bytes_to_number(s, 1));
+    }
+    else if (encoding == BITS_RUNS)
     {
-        if (bgzf_read(bgzf_, data, size) != size)
+        uint64_t runs = read_varint(s);
+        seqpos_t pos = 0;
+        for (uint64_t i = 0; i < runs; ++i)
         {
-            throw std::runtime_error("Unreadable BGZF file" +
-                                     string(bin_fname_));
+            seqpos_t run = read_varint(s);
+            if (pos + run > length)
+            {
+                delete bits;
+                throw std::runtime_error("Corrupted bit vector in " +
+                                         string(header_fname_));
+            }
+            if (i % 2 == 1) bits->set_range(pos, pos + run);
+            pos += run;
         }
     }
     else
     {
-        ibin_.read(data, size);
-        if (ibin_.gcount() != size)
+        delete bits;
+        throw std::runtime_error("Unknown bit vector encoding in " +
+                                 string(header_fname_));
+    }
+    return bits;
+}
+
+// Read header of the v2 format, which has the same sections as the original
+// one with all numbers stored as varints. Index items carry record lengths
+// and positions relative to the end of the preceding item. In the v3 format
+// they also list supplement records with informants added later, the v4
+// format adds the coverage index after them and the v5 format summaries of
+// informants to index items.
+void IOHandler::read_header_v2(istream &s, map <string, bioid_t> &genome_map,
+    vector <map <string, pair <bioid_t, seqpos_t> > > &chr_maps,
+    map <bioid_t, vector <IndexItem*> > &index)
+{
+    char magic[FORMAT_MAGIC_SIZE];
+    s.read(magic, FORMAT_MAGIC_SIZE);
+    format_version_ = bytes_to_number(s, 1);
+    if ((memcmp(magic, FORMAT_MAGIC, FORMAT_MAGIC_SIZE) != 0) ||
+        (format_version_ < FORMAT_V2) || (format_version_ > FORMAT_V5))
+    {
+        throw std::runtime_error("Unsupported format of " +
+                                 string(header_fname_));
+    }
+    if (read_varint(s) != SELECT_BITS)
+    {
+        throw std::runtime_error("Select directories of " +
+                                 string(header_fname_) +
+                                 " have different sampling");
+    }
+    
+    uint64_t genome_count = read_varint(s);
+    for (uint64_t i = 0; i < genome_count; ++i)
+    {
+        string name;
+        name.resize(read_varint(s));
+        s.read(&name[0], name.size());
+        genome_map[name] = read_varint(s);
+    }
+    for (uint64_t i = 0; i < genome_count; ++i)
+    {
+        uint64_t chr_count = read_varint(s);
+        map <string, pair <bioid_t, seqpos_t> > chr_map;
+        for (uint64_t j = 0; j < chr_count; ++j)
         {
-            throw std::runtime_error("Unreadable binary file" +
-                                     string(bin_fname_));
+            string name;
+            name.resize(read_varint(s));
+            s.read(&name[0], name.size());
+            bioid_t chr_id = read_varint(s);
+            seqpos_t chr_len = to_chr_length(read_varint(s));
+            chr_map[name] = make_pair(chr_id, chr_len);
         }
+        chr_maps.push_back(chr_map);
     }
-    for (int i = 0; i < size; ++i)
+    
+    uint64_t index_count = read_varint(s);
+    for (uint64_t i = 0; i < index_count; ++i)
     {
-        number <<= 8;
-        number += (unsigned uint8_t)data[i];
+        bioid_t chr_id = read_varint(s);
+        uint64_t ref_count = read_varint(s);
+        vector<IndexItem*> chr_index;
+        seqpos_t last_end = 0;
+        for (uint64_t j = 0; j < ref_count; ++j)
+        {
+            bool strand = bytes_to_number(s, STRAND_SIZE);
+            seqpos_t chr_pos = last_end + read_signed_varint(s);
+            seqpos_t bases_count = read_varint(s);
+            uint64_t pointer = read_varint(s);
+            chr_index.push_back(new IndexItem(strand, chr_pos, bases_count,
+                                              pointer));
+            chr_index.back()->set_record_length(read_varint(s));
+            uint64_t supplement_count = 0;
+            if (format_version_ >= FORMAT_V3)
+                supplement_count = read_varint(s);
+            for (uint64_t k = 0; k < supplement_count; ++k)
+            {
+                uint64_t pointer = read_varint(s);
+                chr_index.back()->add_supplement(pointer, read_varint(s));
+            }
+            uint64_t summary_count = 0;
+            if (format_version_ >= FORMAT_V5) summary_count = read_varint(s);
+            for (uint64_t k = 0; k < summary_count; ++k)
+            {
+                BlockSummary summary;
+                summary.inf_id = read_varint(s);
+                summary.chr_id = read_varint(s);
+                int flags = bytes_to_number(s, 1);
+                summary.strand = flags & 1;
+                summary.ordered = flags & 2;
+                summary.first_chr_pos = read_varint(s);
+                summary.first_seq_pos = read_varint(s);
+                summary.last_inf_end = summary.first_chr_pos +
+                                       read_signed_varint(s);
+                summary.last_ref_end = summary.first_seq_pos +
+                                       read_signed_varint(s);
+                summary.max_inf_gap = read_varint(s);
+                summary.max_ref_gap = read_varint(s);
+                chr_index.back()->get_summaries().push_back(summary);
+            }
+            last_end = chr_pos + bases_count;
+        }
+        index[chr_id] = chr_index;
+    }
+    
+    // Coverage index: bit vectors over blocks of a reference chromosome
+    has_coverage_ = (format_version_ >= FORMAT_V4);
+    has_summaries_ = (format_version_ >= FORMAT_V5);
+    uint64_t coverage_count = has_coverage_ ? read_varint(s) : 0;
+    for (uint64_t i = 0; i < coverage_count; ++i)
+    {
+        bioid_t chr_id = read_varint(s);
+        bioid_t inf_id = read_varint(s);
+        BitVector* &bits = coverage_[make_pair(chr_id, inf_id)];
+        delete bits;
+        bits = read_bit_vector(s, index[chr_id].size());
     }
-    return number;
 }
 
-int IOHandler::max(int a, int b)
+// Whether the coverage index tells that informant 'inf_id' has no bases
+// aligned to the given block of the reference chromosome
+bool IOHandler::is_unaligned(bioid_t ref_chr_id, bioid_t inf_id, int block)
 {
-    if (a > b) return a;
-    return b;
+    if (!has_coverage_) return false;
+    auto it = coverage_.find(make_pair(ref_chr_id, inf_id));
+    return (it == coverage_.end()) || !(*it->second)[block];
 }
 
-// Read from BGZF/BIN file binary sequence of length 'length'
-vector<bool>* IOHandler::read_bin_sequence(seqpos_t length,
-                                           vector<int>* rankselect,
-                                           bool selecting)
-//TODO: this needs to be changed if the format of data in BGZF file will change
+bool IOHandler::has_summaries()
 {
-    if (!map_) return new vector<bool>;
-    seqpos_t real_length = length/8;
-    if (length % 8 != 0) real_length += 1;
-    // Read sequence
-    char* data = new char[real_length];
-    if (compressed_)
+    return has_summaries_;
+}
+
+// Share inflated records of the store with other processes attached to the
+// pool of the given name. Uncompressed stores are shared by the page cache
+// already, so the pool is used only for BGZF stores.
+void IOHandler::attach_shared_pool(const string &name)
+{
+    if (!compressed_ || (pool_ != NULL)) return;
+    pool_ = new SharedPool(name);
+    shard_ids_.clear();
+    for (unsigned i = 0; i < shard_fnames_.size(); ++i)
+        shard_ids_.push_back(SharedPool::file_id(shard_fnames_[i]));
+}
+
+// Decode blocks of one query missing in the cache by 'threads' threads at
+// once (all cores if 0)
+void IOHandler::set_threads(unsigned threads)
+{
+    threads_ = threads;
+    if (threads_ == 0) threads_ = std::thread::hardware_concurrency();
+    if (threads_ == 0) threads_ = 1;
+}
+
+void IOHandler::print_stats()
+{
+    if (pool_ == NULL) return;
+    uint64_t lookups = pool_->get_hits() + pool_->get_misses();
+    std::cerr << "Shared pool: " << pool_->get_hits() << " hits, "
+              << pool_->get_misses() << " misses ("
+              << (lookups > 0 ? 100.0 * pool_->get_hits() / lookups : 0)
+              << "% hit rate)" << std::endl;
+}
+
+// Print bytes taken by the header tables, the cached blocks (as they are
+// now, with segments built since they were read) and their informant arrays
+void IOHandler::print_memory()
+{
+    uint64_t cache_bytes = cache_.memory_usage(), array_bytes = 0;
+    for (auto it = informant_arrays_.begin(); it != informant_arrays_.end();
+         ++it)
     {
-        if (bgzf_read(bgzf_, data, real_length) != real_length)
+        array_bytes += it->second->memory_usage();
+    }
+    std::cerr << "Memory: header " << header_bytes_ << " bytes, block cache "
+              << cache_bytes << " bytes in " << cache_.size()
+              << " blocks (peak " << std::max(cache_.get_peak_bytes(),
+                                              cache_bytes)
+              << " bytes), informant arrays " << array_bytes << " bytes"
+              << std::endl;
+}
+
+// Set lengths of records which can be told from the offset of the record
+// following them in the BGZF/BIN file
+void IOHandler::set_record_lengths(map <bioid_t, vector<IndexItem*> > &index)
+{
+    // Items by shard and pointer
+    vector< pair< pair<int, uint64_t>, IndexItem*> > items;
+    for (auto it = index.begin(); it != index.end(); ++it)
+    {
+        int shard = 0;
+        if (chr_shards_.count(it->first) > 0) shard = chr_shards_[it->first];
+        else if (!chr_shards_.empty()) continue;
+        for (auto it2 = it->second.begin(); it2 != it->second.end(); ++it2)
         {
-            delete[] data;
-            throw std::runtime_error("Unreadable BGZF file" +
-                                     string(bin_fname_));
+            items.push_back(make_pair(make_pair(shard,
+                                                (*it2)->get_pointer()),
+                                      *it2));
         }
     }
-    else
+    std::sort(items.begin(), items.end());
+    vector<uint64_t> file_ends(shard_fnames_.size(), 0);
+    for (unsigned i = 0; (i < shard_fnames_.size()) && !compressed_; ++i)
+    {
+        ifstream bin(shard_fnames_[i].c_str(),
+                     std::ios::in | std::ios::binary);
+        bin.seekg(0, std::ios::end);
+        if (bin.good()) file_ends[i] = bin.tellg();
+    }
+    for (unsigned i = 0; i < items.size(); ++i)
+    {
+        int shard = items[i].first.first;
+        uint64_t pointer = items[i].first.second;
+        uint64_t next = file_ends[shard];
+        if ((i + 1 < items.size()) && (items[i+1].first.first == shard))
+            next = items[i+1].first.second;
+        if (next <= pointer) continue;
+        // BGZF virtual offsets can only be subtracted within one BGZF block
+        if (compressed_ && ((next >> 16) != (pointer >> 16))) continue;
+        items[i].second->set_record_length(next - pointer);
+    }
+}
+
+// Make the file with records of the given reference chromosome current,
+// open it if it is not open yet
+void IOHandler::select_shard(bioid_t ref_chr_id)
+{
+    int shard = 0;
+    if (!chr_shards_.empty())
     {
-        ibin_.read(data, real_length);
-        if (ibin_.gcount() != real_length)
+        auto it = chr_shards_.find(ref_chr_id);
+        if (it == chr_shards_.end())
         {
-            delete[] data;
-            throw std::runtime_error("Unreadable binary file" +
-                                     string(bin_fname_));
+            throw std::runtime_error("Manifest " + string(bin_fname_) +
+                                     " has no shard for a queried chromosome");
         }
+        shard = it->second;
+    }
+    // The kind of the file is chosen once, when the file is first read
+    if (shard_sources_[shard] == NULL)
+    {
+        const string &fname = shard_fnames_[shard];
+        if (is_projection_)
+            shard_sources_[shard] = new MappedSource(fname);
+        else if (compressed_)
+            shard_sources_[shard] = new BgzfSource(fname);
+        else shard_sources_[shard] = new FileSource(fname);
     }
-    // Convert read data to vector of booleans, optionally fill rank/select
-    vector<bool>* ret = new vector<bool>;
-    ret->reserve(length);
+    shard_ = shard;
+    source_ = shard_sources_[shard];
+}
+
+// Seek to the record at 'pointer' in the current file
+void IOHandler::seek_record(uint64_t pointer)
+{
+    source_->seek(pointer);
+}
+
+// Make sure 'size' unparsed bytes of the record are in memory, read the
+// missing ones from the current file
+void IOHandler::fetch(size_t size)
+{
+    if (record_pos_ + size <= record_.size()) return;
+    size_t missing = record_pos_ + size - record_.size();
+    record_.resize(record_pos_ + size);
+    char* data = &record_[record_.size() - missing];
+    source_->read(data, missing);
+}
+
+// Start a new record at 'pointer' of the current file; take it from the
+// shared pool if it is there, otherwise read it as a whole if its length is
+// known, or by parts as it is parsed. Return whether it came from the pool.
+bool IOHandler::load_record(uint64_t pointer, uint64_t length)
+{
+    record_.clear();
+    record_pos_ = 0;
+    if ((pool_ != NULL) && pool_->get(shard_ids_[shard_], pointer, record_))
+        return true;
+    seek_record(pointer);
+    fetch(length);
+    return false;
+}
+
+// Offer the record just parsed to the shared pool, all of its bytes are in
+// record_ by now
+void IOHandler::share_record(uint64_t pointer)
+{
+    if (pool_ == NULL) return;
+    pool_->put(shard_ids_[shard_], pointer, record_.data(), record_.size());
+}
+
+// Parse number of 'size' bytes from the record
+uint64_t IOHandler::parse_number(const int size)
+{
+    fetch(size);
+    uint64_t number = decode_number(&record_[record_pos_], size);
+    record_pos_ += size;
+    return number;
+}
+
+// Parse binary sequence of length 'length' from the record, its bits are
+// stored from the highest one, the last byte is aligned right
+BitVector* IOHandler::parse_sequence(seqpos_t length,
+                                     vector<seqpos_t>* rankselect,
+                                     bool selecting)
+//TODO: this needs to be changed if the format of data in BGZF file will change
+{
+    if (!map_) return new BitVector();
+    seqpos_t real_length = length/8;
+    if (length % 8 != 0) real_length += 1;
+    fetch(real_length);
+    const char* data = &record_[record_pos_];
+    record_pos_ += real_length;
+    // Convert read data to a bit vector, optionally fill rank/select
+    BitVector* ret = new BitVector(length);
     if (rankselect != NULL)
     {
         if (selecting) rankselect->push_back(-1);
     }
-    int one_bits = 0;
-    for (unsigned int i = 0; i < real_length; ++i)
+    seqpos_t one_bits = 0;
+    for (seqpos_t i = 0; i < real_length; ++i)
     {
         if ((rankselect != NULL) && (!selecting) && ((i*8) % RANK_BITS == 0))
             rankselect->push_back(one_bits);
-        for (unsigned int j = max(0, 8 - length + i*8); j < 8; ++j)
+        // Bits of the byte in order of positions, lowest bit first
+        int bits_count = 8;
+        uint8_t byte = data[i];
+        if (i*8 + 8 > length)
         {
-            ret->push_back((bool)((data[i] >> (7-j)) & 1));
-            one_bits += ((data[i] >> (7-j)) & 1);
-            if ((rankselect != NULL) && selecting && (one_bits == SELECT_BITS))
+            bits_count = length - i*8;
+            byte <<= 8 - bits_count;
+        }
+        // Reverse order of bits in the byte
+        uint8_t bits = ((byte * 0x0202020202ULL) & 0x010884422010ULL) % 1023;
+        ret->set_bits(i*8, bits);
+        if ((rankselect != NULL) && selecting &&
+            (one_bits + __builtin_popcount(bits) >= SELECT_BITS))
+        {
+            for (int j = 0; j < bits_count; ++j)
             {
-                one_bits = 0;
-                rankselect->push_back(ret->size()-1);
+                one_bits += (bits >> j) & 1;
+                if (one_bits == SELECT_BITS)
+                {
+                    one_bits = 0;
+                    rankselect->push_back(i*8 + j);
+                }
             }
         }
+        else one_bits += __builtin_popcount(bits);
     }
-    delete[] data;
     return ret;
 }
 
-// Read from BGZF/BIN file references on given indices
+// Read from BGZF/BIN file references on given indices. They are owned by
+// the cache and stay valid while their handles appended to 'handles' are
+// kept.
 vector<Reference*>* IOHandler::read_references(vector<IndexItem*> &index_items,
                                                bioid_t ref_chr_id,
-                                               int indices[])
+                                               int indices[],
+                                               vector<ReferenceHandle>
+                                               &handles)
 {
     vector<Reference*>* references = new vector<Reference*>;
     if (!map_opened_) return references;
+    // Pin the cached blocks first, so that reading the others does not
+    // evict them
+    size_t first = handles.size();
+    for (int i = indices[0]; i <= indices[1]; ++i)
+    {
+        BlockKey key = make_pair(ref_chr_id, index_items[i]->get_pointer());
+        handles.push_back(cache_.find(key));
+    }
+    vector<int> missing;
+    for (int i = indices[0]; i <= indices[1]; ++i)
+    {
+        if (handles[first + i - indices[0]] == NULL) missing.push_back(i);
+    }
+    vector<ReferenceHandle> evicted;
+    if ((threads_ > 1) && (missing.size() > 1))
+    {
+        vector<ReferenceHandle> loaded(missing.size());
+        load_in_parallel(index_items, ref_chr_id, missing, loaded, evicted);
+        for (unsigned k = 0; k < missing.size(); ++k)
+            handles[first + missing[k] - indices[0]] = loaded[k];
+    }
+    for (auto i = missing.begin(); i != missing.end(); ++i)
+    {
+        ReferenceHandle &handle = handles[first + *i - indices[0]];
+        if (handle != NULL) continue;
+        IndexItem* index_item = index_items[*i];
+        BlockKey key = make_pair(ref_chr_id, index_item->get_pointer());
+        handle = cache_.get(key, [&]()
+        {
+            return load_reference(index_item, ref_chr_id);
+        }, evicted);
+    }
+    for (size_t i = first; i < handles.size(); ++i)
+        references->push_back(handles[i].get());
+    drop_evicted(evicted);
+    return references;
+}
+
+// Decode the given missing blocks by several threads, each reading
+// a consecutive run of them with its own reader, and put them to the cache
+void IOHandler::load_in_parallel(vector<IndexItem*> &index_items,
+                                 bioid_t ref_chr_id, vector<int> &missing,
+                                 vector<ReferenceHandle> &loaded,
+                                 vector<ReferenceHandle> &evicted)
+{
+    unsigned thread_count = std::min<size_t>(threads_, missing.size());
+    while (readers_.size() < thread_count) readers_.push_back(make_reader());
+    vector< vector<ReferenceHandle> > thread_evicted(thread_count);
+    vector<string> errors(thread_count);
+    vector<std::thread> workers;
+    for (unsigned t = 0; t < thread_count; ++t)
+    {
+        workers.push_back(std::thread([&, t]()
+        {
+            try
+            {
+                size_t begin = missing.size() * t / thread_count;
+                size_t end = missing.size() * (t + 1) / thread_count;
+                for (size_t k = begin; k < end; ++k)
+                {
+                    IndexItem* index_item = index_items[missing[k]];
+                    BlockKey key = make_pair(ref_chr_id,
+                                             index_item->get_pointer());
+                    loaded[k] = cache_.get(key, [&]()
+                    {
+                        return readers_[t]->load_reference(index_item,
+                                                           ref_chr_id);
+                    }, thread_evicted[t]);
+                }
+            }
+            catch (std::runtime_error &e)
+            {
+                errors[t] = e.what();
+            }
+        }));
+    }
+    for (auto it = workers.begin(); it != workers.end(); ++it) it->join();
+    for (auto it = thread_evicted.begin(); it != thread_evicted.end(); ++it)
+        evicted.insert(evicted.end(), it->begin(), it->end());
+    for (auto it = errors.begin(); it != errors.end(); ++it)
+    {
+        if (!it->empty())
+        {
+            drop_evicted(evicted);
+            throw std::runtime_error(*it);
+        }
+    }
+}
+
+// Create a reader of records for a decoding thread: it reads the same
+// files (opening them on its own) and shares the pool of this IOHandler
+IOHandler* IOHandler::make_reader()
+{
+    char no_maf[] = "";
+    IOHandler* reader = new IOHandler(header_fname_, bin_fname_, compressed_,
+                                      no_maf);
+    reader->format_version_ = format_version_;
+    reader->is_projection_ = is_projection_;
+    reader->chr_shards_ = chr_shards_;
+    reader->shard_fnames_ = shard_fnames_;
+    reader->shard_sources_.assign(shard_fnames_.size(), NULL);
+    reader->pool_ = pool_;
+    reader->owns_pool_ = false;
+    reader->shard_ids_ = shard_ids_;
+    return reader;
+}
+
+// Read and parse the record of the block of 'index_item' with informants
+// added to it later
+Reference* IOHandler::load_reference(IndexItem* index_item, bioid_t ref_chr_id)
+{
+    select_shard(ref_chr_id);
+    uint64_t pointer = index_item->get_pointer();
+    bool shared = load_record(pointer, index_item->get_record_length());
+    Reference* reference;
+    if (format_version_ == FORMAT_V1)
+        reference = parse_record(index_item, ref_chr_id);
+    else reference = parse_record_v2(index_item, ref_chr_id);
+    if (!shared) share_record(pointer);
+    // Informants added to the store later
+    vector< pair<uint64_t, uint64_t> > &supplements =
+        index_item->get_supplements();
+    for (auto it = supplements.begin(); it != supplements.end(); ++it)
+    {
+        shared = load_record(it->first, it->second);
+        parse_informants_v2(reference);
+        if (!shared) share_record(it->first);
+    }
+    return reference;
+}
+
+// Parse record of the original format
+Reference* IOHandler::parse_record(IndexItem* index_item, bioid_t ref_chr_id)
+{
     seqpos_t length, chr_pos, seq_pos, seq_len, bases_count;
     biocount_t inf_number, inf_block_num;
     bioid_t inf_id, chr_id;
     bool strand;
-    for (int i = indices[0]; i <= indices[1]; ++i)
+    // Read reference information
+    seqpos_t blocks_left = 0;
+    length = parse_number(OLD_SEQPOS_SIZE);
+    vector<seqpos_t>* select = new vector<seqpos_t>;
+    BitVector* sequence = parse_sequence(length, select, true);
+    Reference* reference = new Reference(sequence, select, ref_chr_id,
+                                         index_item->get_chr_pos(),
+                                         index_item->get_strand(),
+                                         index_item->get_bases_count());
+    // Read reference's informant information
+    inf_number = parse_number(OLD_BIOCOUNT_SIZE1);
+    fetch(inf_number * (OLD_BIOID_SIZE1 + OLD_BIOCOUNT_SIZE2));
+    vector< pair<bioid_t, biocount_t> > infs;
+    for (biocount_t j = 0; j < inf_number; ++j)
+    {
+        inf_id = parse_number(OLD_BIOID_SIZE1);
+        inf_block_num = parse_number(OLD_BIOCOUNT_SIZE2);
+        infs.push_back(make_pair(inf_id, inf_block_num));
+        blocks_left += inf_block_num;
+    }
+    for (auto it = infs.begin(); it != infs.end(); ++it)
+    {
+        for (biocount_t k = 0; k < it->second; ++k)
+        {
+            fetch(OLD_BLOCK_HEADER_SIZE);
+            chr_id = parse_number(OLD_BIOID_SIZE2);
+            strand = parse_number(STRAND_SIZE);
+            chr_pos = parse_number(OLD_SEQPOS_SIZE);
+            seq_pos = parse_number(OLD_SEQPOS_SIZE) - 1;
+            seq_len = parse_number(OLD_SEQPOS_SIZE);
+            bases_count = parse_number(OLD_SEQPOS_SIZE);
+            // Fetch the sequence together with the next block's header
+            --blocks_left;
+            fetch((seq_len + 7)/8 +
+                  (blocks_left > 0 ? OLD_BLOCK_HEADER_SIZE : 0));
+            // Uncomment the commented lines to compute rank for informant
+            // (do not forget about commented lines in Sequence.cpp)
+//             vector<int>* rank = new vector<int>;
+            BitVector* sequence = parse_sequence(seq_len);
+//                 parse_sequence(seq_len, rank, false);
+            reference->add_informant(it->first,
+                new Informant(sequence, /*rank,*/ chr_id, chr_pos, strand,
+                              bases_count, seq_pos, reference));
+        }
+    }
+    return reference;
+}
+
+// Parse unsigned varint: 7 bits per byte from the lowest ones, the highest
+// bit of a byte is set if more bytes follow
+uint64_t IOHandler::parse_varint()
+{
+    uint64_t number = 0;
+    for (int shift = 0; shift < 64; shift += 7)
+    {
+        fetch(1);
+        uint8_t byte = record_[record_pos_++];
+        number |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) return number;
+    }
+    throw std::runtime_error("Corrupted varint in " + shard_fnames_[shard_]);
+}
+
+// Parse signed (zigzag encoded) varint
+int64_t IOHandler::parse_signed_varint()
+{
+    uint64_t number = parse_varint();
+    return (int64_t)(number >> 1) ^ -(int64_t)(number & 1);
+}
+
+// Parse bit vector of the v2 format: encoding byte, then either bytes of the
+// words (little-endian, as many as needed) or lengths of alternating runs of
+// '0's and '1's
+BitVector* IOHandler::parse_bit_vector(seqpos_t length)
+{
+    BitVector* bits = new BitVector(length);
+    int encoding = parse_number(1);
+    if (encoding == BITS_RAW)
     {
-        Reference* cached = get_from_cache(index_items[i]->get_pointer());
-        if (cached != NULL)
+        size_t size = (length + 7) / 8;
+        fetch(size);
+        const char* data = &record_[record_pos_];
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        memcpy(bits->words(), data, size);
+#else
+        for (size_t i = 0; i < size; ++i)
+            bits->set_bits(8*i, (uint8_t)data[i]);
+#endif
+        record_pos_ += size;
+    }
+    else if (encoding == BITS_RUNS)
+    {
+        uint64_t runs = parse_varint();
+        seqpos_t pos = 0;
+        for (uint64_t i = 0; i < runs; ++i)
+        {
+            seqpos_t run = parse_varint();
+            if (pos + run > length)
+            {
+                delete bits;
+                throw std::runtime_error("Corrupted bit vector in " +
+                                         shard_fnames_[shard_]);
+            }
+            if (i % 2 == 1) bits->set_range(pos, pos + run);
+            pos += run;
+        }
+    }
+    else
+    {
+        delete bits;
+        throw std::runtime_error("Unknown bit vector encoding in " +
+                                 shard_fnames_[shard_]);
+    }
+    return bits;
+}
+
+// Parse record of the v2 format
+Reference* IOHandler::parse_record_v2(IndexItem* index_item,
+                                      bioid_t ref_chr_id)
+{
+    seqpos_t length = parse_varint();
+    BitVector* sequence = parse_bit_vector(length);
+    // The select directory is stored as differences of its items
+    vector<seqpos_t>* select = new vector<seqpos_t>(parse_varint());
+    seqpos_t last = -1;
+    for (unsigned i = 0; i < select->size(); ++i)
+    {
+        last += parse_varint();
+        (*select)[i] = last;
+    }
+    Reference* reference = new Reference(sequence, select, ref_chr_id,
+                                         index_item->get_chr_pos(),
+                                         index_item->get_strand(),
+                                         index_item->get_bases_count());
+    parse_informants_v2(reference);
+    return reference;
+}
+
+// Parse informant table and blocks of a v2 record (or of a supplement
+// record) and add them to 'reference'
+void IOHandler::parse_informants_v2(Reference* reference)
+{
+    vector< pair<bioid_t, uint64_t> > infs(parse_varint());
+    for (auto it = infs.begin(); it != infs.end(); ++it)
+    {
+        it->first = parse_varint();
+        it->second = parse_varint();
+    }
+    for (auto it = infs.begin(); it != infs.end(); ++it)
+    {
+        // Positions are stored relative to the end of the preceding block
+        seqpos_t inf_end = 0, seq_end = 0;
+        for (uint64_t k = 0; k < it->second; ++k)
+        {
+            bioid_t chr_id = parse_varint();
+            bool strand = parse_number(STRAND_SIZE);
+            seqpos_t chr_pos = inf_end + parse_signed_varint();
+            seqpos_t seq_pos = seq_end + parse_signed_varint();
+            seqpos_t seq_len = parse_varint();
+            seqpos_t bases_count = parse_varint();
+            BitVector* sequence = parse_bit_vector(seq_len);
+            reference->add_informant(it->first,
+                new Informant(sequence, chr_id, chr_pos, strand, bases_count,
+                              seq_pos, reference));
+            inf_end = chr_pos + bases_count;
+            seq_end = seq_pos + seq_len;
+        }
+    }
+}
+
+// Drop blocks evicted from the cache from informant arrays, so that the
+// arrays only hold cached blocks
+void IOHandler::drop_evicted(vector<ReferenceHandle> &evicted)
+{
+    for (auto ref = evicted.begin(); ref != evicted.end(); ++ref)
+    {
+        bioid_t chr_id = (*ref)->get_chr_id();
+        for (auto it = informant_arrays_.lower_bound(make_pair(chr_id, 0));
+             (it != informant_arrays_.end()) && (it->first.first == chr_id);
+             ++it)
+        {
+            it->second->remove(ref->get());
+        }
+    }
+    evicted.clear();
+}
+
+// Get informant array of the given informant containing blocks first_block ..
+// first_block+size-1 of the given reference chromosome, stored in 'references'
+InformantArray* IOHandler::get_informant_array(bioid_t ref_chr_id,
+                                               bioid_t inf_id,
+                                               vector<Reference*> &references,
+                                               int first_block)
+{
+    pair<bioid_t, bioid_t> key = make_pair(ref_chr_id, inf_id);
+    if (informant_arrays_.count(key) == 0)
+        informant_arrays_[key] = new InformantArray();
+    informant_arrays_[key]->extend(first_block, references, inf_id);
+    return informant_arrays_[key];
+}
+
+// Append unsigned varint to 'out'
+void IOHandler::put_varint(string &out, uint64_t number)
+{
+    while (number >= 0x80)
+    {
+        out.push_back((char)((number & 0x7f) | 0x80));
+        number >>= 7;
+    }
+    out.push_back((char)number);
+}
+
+// Append signed (zigzag encoded) varint to 'out'
+void IOHandler::put_signed_varint(string &out, int64_t number)
+{
+    put_varint(out, ((uint64_t)number << 1) ^ (uint64_t)(number >> 63));
+}
+
+// Append bit vector in the v2 format to 'out', as runs if it is shorter
+void IOHandler::put_bit_vector(string &out, BitVector &bits)
+{
+    string runs;
+    uint64_t run_count = 0;
+    seqpos_t run_start = 0;
+    bool value = false;
+    for (seqpos_t i = 0; i <= bits.size(); ++i)
+    {
+        if ((i == bits.size()) || (bits[i] != value))
+        {
+            put_varint(runs, i - run_start);
+            ++run_count;
+            run_start = i;
+            value = !value;
+        }
+    }
+    string run_header;
+    put_varint(run_header, run_count);
+    size_t raw_size = (bits.size() + 7) / 8;
+    if (run_header.size() + runs.size() < raw_size)
+    {
+        out.push_back((char)BITS_RUNS);
+        out += run_header;
+        out += runs;
+        return;
+    }
+    // Bytes of the words from the lowest one, the last word is cut
+    out.push_back((char)BITS_RAW);
+    for (size_t i = 0; i < raw_size; ++i)
+        out.push_back((char)((bits.words()[i / 8] >> (8 * (i % 8))) & 0xff));
+}
+
+// Append the reference sequence and its select directory, the first part
+// of a record of the v2 format
+void IOHandler::put_reference_v2(string &out, Reference* reference)
+{
+    put_varint(out, reference->length());
+    put_bit_vector(out, *reference->get_sequence());
+    vector<seqpos_t>* select = reference->get_rankselect();
+    put_varint(out, select->size());
+    seqpos_t last = -1;
+    for (auto it = select->begin(); it != select->end(); ++it)
+    {
+        put_varint(out, *it - last);
+        last = *it;
+    }
+}
+
+// Append informant table and blocks of the given informants in the v2
+// format to 'out'
+void IOHandler::put_informants_v2(string &out,
+                                  vector< pair<bioid_t, vector<Informant*>*> >
+                                  &infs)
+{
+    put_varint(out, infs.size());
+    for (auto it = infs.begin(); it != infs.end(); ++it)
+    {
+        put_varint(out, it->first);
+        put_varint(out, it->second->size());
+    }
+    for (auto it = infs.begin(); it != infs.end(); ++it)
+    {
+        seqpos_t inf_end = 0, seq_end = 0;
+        vector<Informant*> &informants = *it->second;
+        for (auto inf = informants.begin(); inf != informants.end(); ++inf)
+        {
+            put_varint(out, (*inf)->get_chr_id());
+            out.push_back((char)(*inf)->get_strand());
+            put_signed_varint(out, (*inf)->get_chr_pos() - inf_end);
+            put_signed_varint(out, (*inf)->get_seq_pos() - seq_end);
+            put_varint(out, (*inf)->length());
+            put_varint(out, (*inf)->get_bases_count());
+            put_bit_vector(out, *(*inf)->get_sequence());
+            inf_end = (*inf)->get_chr_pos() + (*inf)->get_bases_count();
+            seq_end = (*inf)->get_seq_pos() + (*inf)->length();
+        }
+    }
+}
+
+// Open BGZF/BIN file for writing records
+void IOHandler::open_output(const string &fname, BGZF* &bgzf,
+                            std::ofstream &bin)
+{
+    if (compressed_) bgzf = bgzf_open(fname.c_str(), "w");
+    else bin.open(fname.c_str(), std::ios::out | std::ios::binary);
+    if ((compressed_ && (bgzf == NULL)) || (!compressed_ && !bin.is_open()))
+        throw std::runtime_error("Unwritable file " + fname);
+}
+
+// Close BGZF/BIN file opened by open_output
+void IOHandler::close_output(BGZF* &bgzf, std::ofstream &bin)
+{
+    if (compressed_ && (bgzf != NULL)) bgzf_close(bgzf);
+    if (!compressed_ && bin.is_open()) bin.close();
+    bgzf = NULL;
+}
+
+// Write record to BGZF/BIN file opened by open_output, return its pointer.
+// If 'aligned', a record which does not fit in the rest of the current BGZF
+// block starts a new one, so that reading it inflates no more blocks than
+// it spans.
+uint64_t IOHandler::write_output(const string &record, BGZF* bgzf,
+                                 std::ofstream &bin, const string &fname,
+                                 bool aligned)
+{
+    uint64_t pointer;
+    if (compressed_)
+    {
+        if (aligned && (bgzf->block_offset > 0) &&
+            (bgzf->block_offset + record.size() >
+             (size_t)bgzf->uncompressed_block_size) &&
+            (bgzf_flush(bgzf) != 0))
+        {
+            throw std::runtime_error("Unwritable file " + fname);
+        }
+        pointer = bgzf_tell(bgzf);
+        if (bgzf_write(bgzf, record.data(), record.size()) !=
+            (int)record.size())
+        {
+            throw std::runtime_error("Unwritable file " + fname);
+        }
+    }
+    else
+    {
+        pointer = bin.tellp();
+        bin.write(record.data(), record.size());
+    }
+    return pointer;
+}
+
+// Append header of the v2 format (v3 if there are supplement records, v4
+// with the coverage index, v5 with summaries) to 'out'
+void IOHandler::put_header(string &out, map <string, bioid_t> &genome_map,
+                           vector <map <string, pair <bioid_t, seqpos_t> > >
+                           &chr_maps,
+                           map <bioid_t, vector <IndexItem*> > &index)
+{
+    int version = FORMAT_V2;
+    if (has_summaries_) version = FORMAT_V5;
+    else if (has_coverage_) version = FORMAT_V4;
+    string header;
+    put_varint(header, SELECT_BITS);
+    put_varint(header, genome_map.size());
+    for (auto it = genome_map.begin(); it != genome_map.end(); ++it)
+    {
+        put_varint(header, it->first.size());
+        header += it->first;
+        put_varint(header, it->second);
+    }
+    for (auto it = chr_maps.begin(); it != chr_maps.end(); ++it)
+    {
+        put_varint(header, it->size());
+        for (auto chr = it->begin(); chr != it->end(); ++chr)
+        {
+            put_varint(header, chr->first.size());
+            header += chr->first;
+            put_varint(header, chr->second.first);
+            put_varint(header, chr->second.second);
+        }
+    }
+    for (auto it = index.begin(); it != index.end(); ++it)
+    {
+        for (auto item = it->second.begin(); item != it->second.end(); ++item)
+        {
+            if (!(*item)->get_supplements().empty())
+                version = std::max(version, FORMAT_V3);
+        }
+    }
+    string items;
+    put_varint(items, index.size());
+    for (auto it = index.begin(); it != index.end(); ++it)
+    {
+        put_varint(items, it->first);
+        put_varint(items, it->second.size());
+        seqpos_t last_end = 0;
+        for (auto item = it->second.begin(); item != it->second.end(); ++item)
+        {
+            items.push_back((char)(*item)->get_strand());
+            put_signed_varint(items, (*item)->get_chr_pos() - last_end);
+            put_varint(items, (*item)->get_bases_count());
+            put_varint(items, (*item)->get_pointer());
+            put_varint(items, (*item)->get_record_length());
+            last_end = (*item)->get_chr_pos() + (*item)->get_bases_count();
+            if (version == FORMAT_V2) continue;
+            vector< pair<uint64_t, uint64_t> > &supplements =
+                (*item)->get_supplements();
+            put_varint(items, supplements.size());
+            for (auto sup = supplements.begin(); sup != supplements.end();
+                 ++sup)
+            {
+                put_varint(items, sup->first);
+                put_varint(items, sup->second);
+            }
+            if (version < FORMAT_V5) continue;
+            vector<BlockSummary> &summaries = (*item)->get_summaries();
+            put_varint(items, summaries.size());
+            for (auto sum = summaries.begin(); sum != summaries.end(); ++sum)
+            {
+                put_varint(items, sum->inf_id);
+                put_varint(items, sum->chr_id);
+                items.push_back((char)(sum->strand | (sum->ordered << 1)));
+                put_varint(items, sum->first_chr_pos);
+                put_varint(items, sum->first_seq_pos);
+                put_signed_varint(items,
+                                  sum->last_inf_end - sum->first_chr_pos);
+                put_signed_varint(items,
+                                  sum->last_ref_end - sum->first_seq_pos);
+                put_varint(items, sum->max_inf_gap);
+                put_varint(items, sum->max_ref_gap);
+            }
+        }
+    }
+    out.append(FORMAT_MAGIC, FORMAT_MAGIC_SIZE);
+    out.push_back((char)version);
+    out += header;
+    out += items;
+    if (version >= FORMAT_V4)
+    {
+        put_varint(out, coverage_.size());
+        for (auto it = coverage_.begin(); it != coverage_.end(); ++it)
+        {
+            put_varint(out, it->first.first);
+            put_varint(out, it->first.second);
+            put_bit_vector(out, *it->second);
+        }
+    }
+}
+
+// Write header to a new file and move it over the old one, so that a failed
+// write does not damage the store
+void IOHandler::write_header(const string &fname,
+                             map <string, bioid_t> &genome_map,
+                             vector <map <string, pair <bioid_t, seqpos_t> > >
+                             &chr_maps,
+                             map <bioid_t, vector <IndexItem*> > &index)
+{
+    string header;
+    put_header(header, genome_map, chr_maps, index);
+    string tmp_fname = fname + ".tmp";
+    std::ofstream h(tmp_fname.c_str(), std::ios::out | std::ios::binary);
+    h.write(header.data(), header.size());
+    h.close();
+    if (h.fail() || (std::rename(tmp_fname.c_str(), fname.c_str()) != 0))
+        throw std::runtime_error("Unwritable file " + fname);
+}
+
+namespace
+{
+    // Sort half-open regions and merge the overlapping ones
+    void merge_regions(vector< pair<seqpos_t, seqpos_t> > &regions)
+    {
+        std::sort(regions.begin(), regions.end());
+        vector< pair<seqpos_t, seqpos_t> > merged;
+        for (auto it = regions.begin(); it != regions.end(); ++it)
+        {
+            if (merged.empty() || (it->first > merged.back().second))
+                merged.push_back(*it);
+            else if (it->second > merged.back().second)
+                merged.back().second = it->second;
+        }
+        regions.swap(merged);
+    }
+    
+    // Whether any of the merged regions overlaps positions start .. end-1
+    bool overlaps(vector< pair<seqpos_t, seqpos_t> > &regions,
+                  seqpos_t start, seqpos_t end)
+    {
+        // The last region starting before 'end' ends the latest of them
+        auto it = std::lower_bound(regions.begin(), regions.end(),
+                                   make_pair(end, (seqpos_t)0));
+        return (it != regions.begin()) && ((it - 1)->second > start);
+    }
+}
+
+// Write all alignments to a new header and BGZF/BIN file in the v2 format,
+// records in order of reference chromosomes and positions. If 'sharded',
+// 'bin_fname' is a manifest and records of each reference chromosome are
+// written to a file named after the manifest and the chromosome. If
+// 'aligned', records are not split between BGZF blocks unless they are
+// larger than a block.
+void IOHandler::convert(char header_fname[], char bin_fname[],
+                        map <string, bioid_t> &genome_map,
+                        vector <map <string, pair <bioid_t, seqpos_t> > >
+                        &chr_maps,
+                        map <bioid_t, vector <IndexItem*> > &index,
+                        bool sharded, bool aligned)
+{
+    map <bioid_t, string> chr_names;
+    for (auto it = chr_maps[0].begin(); it != chr_maps[0].end(); ++it)
+        chr_names[it->second.first] = it->first;
+    // All ids are kept
+    map <bioid_t, bioid_t> chr_ids, inf_ids;
+    for (auto it = index.begin(); it != index.end(); ++it)
+        chr_ids[it->first] = it->first;
+    for (auto it = genome_map.begin(); it != genome_map.end(); ++it)
+    {
+        if (it->second != 0) inf_ids[it->second] = it->second;
+    }
+    write_records(bin_fname, chr_names, chr_ids, inf_ids, index, sharded,
+                  aligned);
+    write_header(header_fname, genome_map, chr_maps, index);
+}
+
+// Write a store with only the selected reference chromosomes, the blocks
+// overlapping the selected regions and the selected informants, records
+// laid out as by "repack". Genomes and reference chromosomes are renumbered
+// in the order of their old ids, informant chromosomes no written block
+// refers to are left out of the header. Coordinates are not changed.
+void IOHandler::slice(char header_fname[], char bin_fname[],
+                      map <string, bioid_t> &genome_map,
+                      vector <map <string, pair <bioid_t, seqpos_t> > >
+                      &chr_maps,
+                      map <bioid_t, vector <IndexItem*> > &index,
+                      SliceSelection &selection, bool sharded)
+{
+    vector<string> &informants = selection.informants;
+    for (auto it = informants.begin(); it != informants.end(); ++it)
+    {
+        auto inf = genome_map.find(*it);
+        if ((inf == genome_map.end()) || (inf->second == 0))
+            throw std::runtime_error("Unknown informant " + *it);
+    }
+    vector<string> &chromosomes = selection.chromosomes;
+    for (auto it = chromosomes.begin(); it != chromosomes.end(); ++it)
+    {
+        if (chr_maps[0].count(*it) == 0)
+            throw std::runtime_error("Unknown reference chromosome " + *it);
+    }
+    
+    // Genomes in the order of their old ids, the reference first
+    map <bioid_t, string> genome_names;
+    for (auto it = genome_map.begin(); it != genome_map.end(); ++it)
+        genome_names[it->second] = it->first;
+    map <bioid_t, bioid_t> inf_ids;
+    map <string, bioid_t> new_genome_map;
+    vector <map <string, pair <bioid_t, seqpos_t> > > new_chr_maps(1);
+    for (auto it = genome_names.begin(); it != genome_names.end(); ++it)
+    {
+        if ((it->first != 0) && !informants.empty() &&
+            (std::find(informants.begin(), informants.end(), it->second) ==
+             informants.end()))
         {
-            references->push_back(cached);
             continue;
         }
-        // Seek in BGZF/BIN file
-        if (compressed_)
+        if (it->first != 0)
         {
-            if (bgzf_seek(bgzf_, index_items[i]->get_pointer(), SEEK_SET) == -1)
+            inf_ids[it->first] = new_chr_maps.size();
+            new_chr_maps.push_back(map <string, pair <bioid_t, seqpos_t> >());
+        }
+        new_genome_map[it->second] = (it->first == 0) ? 0 : inf_ids[it->first];
+    }
+    
+    // Blocks of the selected chromosomes overlapping the selected regions,
+    // the other ones are dropped
+    map <bioid_t, string> chr_names;
+    for (auto it = chr_maps[0].begin(); it != chr_maps[0].end(); ++it)
+        chr_names[it->second.first] = it->first;
+    for (auto it = selection.regions.begin(); it != selection.regions.end();
+         ++it)
+    {
+        merge_regions(it->second);
+    }
+    map <bioid_t, vector <IndexItem*> > kept;
+    for (auto it = index.begin(); it != index.end(); ++it)
+    {
+        const string &name = chr_names[it->first];
+        bool selected = chromosomes.empty() ||
+            (std::find(chromosomes.begin(), chromosomes.end(), name) !=
+             chromosomes.end());
+        vector< pair<seqpos_t, seqpos_t> > &regions =
+            selection.regions[name];
+        for (auto item = it->second.begin(); item != it->second.end(); ++item)
+        {
+            if (selected && (!selection.has_regions ||
+                             overlaps(regions, (*item)->get_chr_pos(),
+                                      (*item)->get_chr_pos() +
+                                      (*item)->get_bases_count())))
             {
-                throw std::runtime_error("Unreadable binary file" +
-                                        string(bin_fname_));
+                kept[it->first].push_back(*item);
             }
+            else delete *item;
         }
-        else
+    }
+    index.swap(kept);
+    map <bioid_t, bioid_t> chr_ids;
+    for (auto it = chr_names.begin(); it != chr_names.end(); ++it)
+    {
+        bool selected = chromosomes.empty() ||
+            (std::find(chromosomes.begin(), chromosomes.end(), it->second) !=
+             chromosomes.end());
+        if (!selected || (selection.has_regions && !index.count(it->first)))
+            continue;
+        bioid_t chr_id = chr_ids.size();
+        chr_ids[it->first] = chr_id;
+        new_chr_maps[0][it->second] =
+            make_pair(chr_id, chr_maps[0][it->second].second);
+    }
+    
+    std::set< pair<bioid_t, bioid_t> > inf_chrs;
+    write_records(bin_fname, chr_names, chr_ids, inf_ids, index, sharded,
+                  true, &inf_chrs);
+    map <bioid_t, vector <IndexItem*> > renumbered;
+    for (auto it = index.begin(); it != index.end(); ++it)
+        renumbered[chr_ids[it->first]].swap(it->second);
+    index.swap(renumbered);
+    for (auto it = inf_ids.begin(); it != inf_ids.end(); ++it)
+    {
+        map <string, pair <bioid_t, seqpos_t> > &chr_map =
+            chr_maps[it->first];
+        for (auto chr = chr_map.begin(); chr != chr_map.end(); ++chr)
         {
-            ibin_.seekg((int)index_items[i]->get_pointer());
-            if (ibin_.fail())
+            if (inf_chrs.count(make_pair(it->second, chr->second.first)))
+                new_chr_maps[it->second][chr->first] = chr->second;
+        }
+    }
+    write_header(header_fname, new_genome_map, new_chr_maps, index);
+}
+
+// Write records of the blocks in 'index' to a new BGZF/BIN file or its
+// shards, as described by "convert". Only informants in 'inf_ids' are
+// written, renumbered by it; reference chromosomes are renumbered by
+// 'chr_ids' in the coverage index. Informant chromosomes the blocks refer
+// to are added to 'inf_chrs' by new informant id, unless it is NULL.
+void IOHandler::write_records(char bin_fname[],
+                              map <bioid_t, string> &chr_names,
+                              map <bioid_t, bioid_t> &chr_ids,
+                              map <bioid_t, bioid_t> &inf_ids,
+                              map <bioid_t, vector <IndexItem*> > &index,
+                              bool sharded, bool aligned,
+                              std::set< pair<bioid_t, bioid_t> > *inf_chrs)
+{
+    BGZF* bgzf = NULL;
+    std::ofstream bin;
+    std::ofstream manifest;
+    string fname(bin_fname);
+    if (sharded)
+    {
+        manifest.open(bin_fname, std::ios::out);
+        manifest << SHARD_MANIFEST_MAGIC << "\n";
+    }
+    else open_output(fname, bgzf, bin);
+    
+    // Records with informants added later included, remembering where they
+    // were written and which informants have aligned bases in them
+    map <pair<bioid_t, bioid_t>, BitVector*> coverage;
+    for (auto it = index.begin(); it != index.end(); ++it)
+    {
+        if (sharded)
+        {
+            fname = string(bin_fname) + "." + chr_names[it->first] +
+                (compressed_ ? ".bgzf" : ".bin");
+            close_output(bgzf, bin);
+            open_output(fname, bgzf, bin);
+            // Shards are listed relative to the manifest
+            string listed = fname;
+            size_t slash = listed.rfind('/');
+            if (slash != string::npos) listed.erase(0, slash + 1);
+            manifest << chr_names[it->first] << "\t" << listed << "\n";
+        }
+        bioid_t chr_id = chr_ids[it->first];
+        vector< pair<uint64_t, uint64_t> > written;
+        for (int i = 0; i < (int)it->second.size(); ++i)
+        {
+            int indices[2] = {i, i};
+            vector<ReferenceHandle> handles;
+            vector<Reference*>* references = read_references(it->second,
+                                                             it->first,
+                                                             indices, handles);
+            Reference* reference = (*references)[0];
+            delete references;
+            vector<bioid_t> old_ids = reference->get_informant_ids();
+            vector< pair<bioid_t, vector<Informant*>*> > infs;
+            it->second[i]->get_summaries().clear();
+            for (auto old_id = old_ids.begin(); old_id != old_ids.end();
+                 ++old_id)
             {
-                throw std::runtime_error("Unreadable binary file" +
-                                        string(bin_fname_));
+                auto inf_id = inf_ids.find(*old_id);
+                if (inf_id == inf_ids.end()) continue;
+                vector<Informant*>* informants =
+                    reference->get_informant_vector(*old_id);
+                infs.push_back(make_pair(inf_id->second, informants));
+                it->second[i]->get_summaries().push_back(
+                    BlockSummary(inf_id->second, informants->begin(),
+                                 informants->end() - 1));
+                for (auto inf = informants->begin();
+                     (inf_chrs != NULL) && (inf != informants->end()); ++inf)
+                {
+                    inf_chrs->insert(make_pair(inf_id->second,
+                                               (*inf)->get_chr_id()));
+                }
+                if (reference->get_segments(*old_id)->empty()) continue;
+                BitVector* &bits = coverage[make_pair(chr_id,
+                                                      inf_id->second)];
+                if (bits == NULL) bits = new BitVector(it->second.size());
+                bits->set(i);
             }
+            string record;
+            put_reference_v2(record, reference);
+            put_informants_v2(record, infs);
+            written.push_back(make_pair(write_output(record, bgzf, bin,
+                                                     fname, aligned),
+                                        record.size()));
+        }
+        for (unsigned i = 0; i < written.size(); ++i)
+        {
+            it->second[i]->set_pointer(written[i].first);
+            it->second[i]->set_record_length(written[i].second);
+            it->second[i]->get_supplements().clear();
         }
-        // Read reference information
-        length = read_bin_number(OLD_SEQPOS_SIZE);
-        vector<int>* select = new vector<int>;
-        vector<bool>* sequence = read_bin_sequence(length, select, true);
-        references->push_back(new Reference(sequence, select, ref_chr_id,
-                              index_items[i]->get_chr_pos(),
-                              index_items[i]->get_strand(),
-                              index_items[i]->get_bases_count()));
-        // Read reference's informant information
-        inf_number = read_bin_number(OLD_BIOCOUNT_SIZE1);
-        vector< pair<bioid_t, biocount_t> > infs;
-        for (int j = 0; j < inf_number; ++j)
-        {
-            inf_id = read_bin_number(OLD_BIOID_SIZE1);
-            inf_block_num = read_bin_number(OLD_BIOCOUNT_SIZE2);
-            infs.push_back(make_pair(inf_id, inf_block_num));
-        }
-        for (auto it = infs.begin(); it != infs.end(); ++it)
-        {
-            for (int k = 0; k < it->second; ++k)
+    }
+    close_output(bgzf, bin);
+    if (sharded)
+    {
+        manifest.close();
+        if (manifest.fail())
+            throw std::runtime_error("Unwritable file " + string(bin_fname));
+    }
+    for (auto it = coverage_.begin(); it != coverage_.end(); ++it)
+        delete it->second;
+    coverage_.swap(coverage);
+    has_coverage_ = true;
+    has_summaries_ = true;
+}
+
+// Write the alignment of the reference to one informant as a pairwise
+// projection: an uncompressed file with records holding only that
+// informant (renumbered to PROJECTION_INF_ID), followed by a v5 header of
+// the reference and the informant
+void IOHandler::extract(char out_fname[], string &informant,
+                        map <string, bioid_t> &genome_map,
+                        vector <map <string, pair <bioid_t, seqpos_t> > >
+                        &chr_maps,
+                        map <bioid_t, vector <IndexItem*> > &index)
+{
+    auto inf = genome_map.find(informant);
+    if ((inf == genome_map.end()) || (inf->second == 0))
+        throw std::runtime_error("Unknown informant " + informant);
+    bioid_t inf_id = inf->second;
+    string fname(out_fname);
+    string tmp_fname = fname + ".tmp";
+    std::ofstream out(tmp_fname.c_str(), std::ios::out | std::ios::binary);
+    if (!out.is_open()) throw std::runtime_error("Unwritable file " + fname);
+    out.write(PROJECTION_MAGIC, FORMAT_MAGIC_SIZE);
+    out.write(string(PROJECTION_OFFSET_SIZE, '\0').data(),
+              PROJECTION_OFFSET_SIZE);
+    
+    map <pair<bioid_t, bioid_t>, BitVector*> coverage;
+    for (auto it = index.begin(); it != index.end(); ++it)
+    {
+        vector< pair<uint64_t, uint64_t> > written;
+        vector<BlockSummary> summaries;
+        for (int i = 0; i < (int)it->second.size(); ++i)
+        {
+            int indices[2] = {i, i};
+            vector<ReferenceHandle> handles;
+            vector<Reference*>* references = read_references(it->second,
+                                                             it->first,
+                                                             indices, handles);
+            Reference* reference = (*references)[0];
+            delete references;
+            string record;
+            put_reference_v2(record, reference);
+            vector< pair<bioid_t, vector<Informant*>*> > infs;
+            vector<Informant*>* informants =
+                reference->get_informant_vector(inf_id);
+            if (!informants->empty())
+            {
+                infs.push_back(make_pair(PROJECTION_INF_ID, informants));
+                summaries.push_back(BlockSummary(PROJECTION_INF_ID,
+                                                 informants->begin(),
+                                                 informants->end() - 1));
+            }
+            else summaries.push_back(BlockSummary());
+            put_informants_v2(record, infs);
+            if (!reference->get_segments(inf_id)->empty())
             {
-                chr_id = read_bin_number(OLD_BIOID_SIZE2);
-                strand = read_bin_number(STRAND_SIZE);
-                chr_pos = read_bin_number(OLD_SEQPOS_SIZE);
-                seq_pos = read_bin_number(OLD_SEQPOS_SIZE) - 1;
-                seq_len = read_bin_number(OLD_SEQPOS_SIZE);
-                bases_count = read_bin_number(OLD_SEQPOS_SIZE);
-                // Uncomment the commented lines to compute rank for informant
-                // (do not forget about commented lines in Sequence.cpp)
-//                 vector<int>* rank = new vector<int>;
-                vector<bool>* sequence = read_bin_sequence(seq_len);
-//                     read_bin_sequence(seq_len, rank, false);
-                (*references)[references->size()-1]->add_informant(
-                    it->first,
-                    new Informant(sequence, /*rank,*/ chr_id, chr_pos, strand,
-                                  bases_count, seq_pos,
-                                  (*references)[references->size()-1]));
+                BitVector* &bits = coverage[make_pair(it->first,
+                                                      PROJECTION_INF_ID)];
+                if (bits == NULL) bits = new BitVector(it->second.size());
+                bits->set(i);
             }
+            written.push_back(make_pair((uint64_t)out.tellp(),
+                                        record.size()));
+            out.write(record.data(), record.size());
+        }
+        for (unsigned i = 0; i < written.size(); ++i)
+        {
+            it->second[i]->set_pointer(written[i].first);
+            it->second[i]->set_record_length(written[i].second);
+            it->second[i]->get_supplements().clear();
+            it->second[i]->get_summaries().clear();
+            if (summaries[i].inf_id == PROJECTION_INF_ID)
+                it->second[i]->get_summaries().push_back(summaries[i]);
         }
     }
-    for (int i = indices[0]; i <= indices[1]; ++i)
+    for (auto it = coverage_.begin(); it != coverage_.end(); ++it)
+        delete it->second;
+    coverage_.swap(coverage);
+    has_coverage_ = true;
+    has_summaries_ = true;
+    
+    // Only the reference and the informant remain
+    map <string, bioid_t> pair_genome_map;
+    for (auto it = genome_map.begin(); it != genome_map.end(); ++it)
     {
-        add_to_cache(index_items[i]->get_pointer(),
-                     (*references)[i-indices[0]]);
+        if (it->second == 0) pair_genome_map[it->first] = 0;
     }
-    return references;
+    pair_genome_map[informant] = PROJECTION_INF_ID;
+    vector <map <string, pair <bioid_t, seqpos_t> > > pair_chr_maps;
+    pair_chr_maps.push_back(chr_maps[0]);
+    pair_chr_maps.push_back(chr_maps[inf_id]);
+    string header;
+    put_header(header, pair_genome_map, pair_chr_maps, index);
+    uint64_t header_offset = out.tellp();
+    out.write(header.data(), header.size());
+    string offset;
+    for (int i = PROJECTION_OFFSET_SIZE - 1; i >= 0; --i)
+        offset.push_back((char)((header_offset >> (8 * i)) & 0xff));
+    out.seekp(FORMAT_MAGIC_SIZE);
+    out.write(offset.data(), offset.size());
+    out.close();
+    if (out.fail() || (std::rename(tmp_fname.c_str(), fname.c_str()) != 0))
+        throw std::runtime_error("Unwritable file " + fname);
 }
 
-void IOHandler::add_to_cache(uint64_t pointer, Reference* reference)
+namespace
 {
-    if ((cache_.count(pointer) > 0) && (cache_[pointer].second == 0)) return;
-    for (auto it = cache_.begin(); it != cache_.end(); ++it)
+    // Sequence line of a MAF block
+    struct MafLine
+    {
+        std::string genome, chr, text;
+        seqpos_t start, src_size;
+        bool strand;
+    };
+    
+    // Parse "s <genome>.<chromosome> <start> <size> <strand> <src_size>
+    // <text>"
+    bool parse_maf_line(const string &line, MafLine &parsed)
     {
-        ++it->second.second;
+        std::istringstream fields(line);
+        string s, src, strand;
+        seqpos_t size;
+        if (!(fields >> s >> src >> parsed.start >> size >> strand >>
+              parsed.src_size >> parsed.text))
+        {
+            return false;
+        }
+        size_t dot = src.find('.');
+        parsed.genome = src.substr(0, dot);
+        parsed.chr = (dot == string::npos) ? "?" : src.substr(dot + 1);
+        parsed.strand = (strand != "-");
+        return true;
     }
-    if (cache_.count(pointer) > 0) cache_[pointer].second = 0;
-    else
+    
+    // Informant block being built from a pairwise alignment
+    struct NewBlock
+    {
+        BitVector* bits;
+        int block;
+        bioid_t chr_id;
+        bool strand;
+        seqpos_t chr_pos, seq_pos, bases_count;
+    };
+    
+    bool precedes(Informant* a, Informant* b)
+    {
+        return a->get_seq_pos() < b->get_seq_pos();
+    }
+}
+
+// Add a new informant from a pairwise alignment of the reference and the
+// informant in MAF format. Its bases are placed into alignment columns of
+// the stored reference blocks (bases inserted between reference bases start
+// a new informant block) and written as supplement records appended to the
+// BGZF/BIN file; stored records are not rewritten, the header is.
+void IOHandler::add_informant(char maf_fname[],
+                              map <string, bioid_t> &genome_map,
+                              vector <map <string, pair <bioid_t, seqpos_t> > >
+                              &chr_maps,
+                              map <bioid_t, vector <IndexItem*> > &index)
+{
+    if (format_version_ == FORMAT_V1)
+    {
+        throw std::runtime_error("Informants can be added only to stores in "
+                                 "the v2 format, use convert first");
+    }
+    string ref_name, inf_name;
+    for (auto it = genome_map.begin(); it != genome_map.end(); ++it)
     {
-        if (cache_.size() == max_cache_size_)
+        if (it->second == 0) ref_name = it->first;
+    }
+    map <string, pair <bioid_t, seqpos_t> > inf_chr_map;
+    // New informant blocks by reference chromosome and reference block
+    map < pair<bioid_t, int>, vector<Informant*> > new_blocks;
+    
+    ifstream maf(maf_fname, std::ios::in);
+    if (!maf.is_open())
+        throw std::runtime_error("Unreadable file " + string(maf_fname));
+    vector<string> lines;
+    string line;
+    bool more = true;
+    while (more)
+    {
+        more = (bool)getline(maf, line);
+        if (more && (line[0] == 's'))
+        {
+            lines.push_back(line);
+            continue;
+        }
+        if (more && !line.empty() && (line[0] != 'a')) continue;
+        // End of an alignment block
+        MafLine ref, inf;
+        bool has_ref = false, has_inf = false;
+        for (auto it = lines.begin(); it != lines.end(); ++it)
+        {
+            MafLine parsed;
+            if (!parse_maf_line(*it, parsed))
+            {
+                throw std::runtime_error("Invalid line in " +
+                                         string(maf_fname) + ": " + *it);
+            }
+            if (parsed.genome == ref_name)
+            {
+                ref = parsed;
+                has_ref = true;
+                continue;
+            }
+            if (inf_name.empty())
+            {
+                inf_name = parsed.genome;
+                if (genome_map.count(inf_name) > 0)
+                {
+                    throw std::runtime_error("Informant " + inf_name +
+                                             " is already in the store");
+                }
+            }
+            if (parsed.genome != inf_name)
+            {
+                throw std::runtime_error(string(maf_fname) + " is not "
+                                         "a pairwise alignment with " +
+                                         ref_name);
+            }
+            inf = parsed;
+            has_inf = true;
+        }
+        lines.clear();
+        if (!has_ref || !has_inf || (chr_maps[0].count(ref.chr) == 0))
+            continue;
+        if (!ref.strand)
         {
-            int max = 0;
-            uint64_t to_erase = 0;
-            for (auto it = cache_.begin(); it != cache_.end(); ++it)
+            throw std::runtime_error("Reference " + ref_name + " is on "
+                                     "the '-' strand in " + string(maf_fname));
+        }
+        bioid_t ref_chr_id = chr_maps[0][ref.chr].first;
+        if (index.count(ref_chr_id) == 0) continue;
+        vector<IndexItem*> &items = index[ref_chr_id];
+        if (inf_chr_map.count(inf.chr) == 0)
+        {
+            bioid_t chr_id = inf_chr_map.size();
+            inf_chr_map[inf.chr] = make_pair(chr_id, inf.src_size);
+        }
+        
+        // Walk the columns, keeping the reference block and its column of
+        // the current reference base
+        seqpos_t ref_pos = ref.start, inf_pos = inf.start;
+        int block = -1;
+        seqpos_t column = -1;
+        Reference* reference = NULL;
+        vector<ReferenceHandle> handles;
+        NewBlock current = NewBlock();
+        for (size_t c = 0; c < ref.text.size(); ++c)
+        {
+            bool ref_base = (ref.text[c] != '-');
+            bool inf_base = (c < inf.text.size()) && (inf.text[c] != '-');
+            if (ref_base && (block != -1) &&
+                (ref_pos < items[block]->get_chr_pos() +
+                 items[block]->get_bases_count()))
+            {
+                // The next reference base in the same block
+                BitVector &bits = *reference->get_sequence();
+                do ++column; while (!bits[column]);
+            }
+            else if (ref_base)
+            {
+                // Block with the last start not after ref_pos
+                int lo = 0, hi = items.size();
+                while (lo < hi)
+                {
+                    int mid = (lo + hi) / 2;
+                    if (items[mid]->get_chr_pos() <= ref_pos) lo = mid + 1;
+                    else hi = mid;
+                }
+                block = lo - 1;
+                if ((block != -1) &&
+                    (ref_pos >= items[block]->get_chr_pos() +
+                     items[block]->get_bases_count()))
+                {
+                    block = -1;
+                }
+                if (block != -1)
+                {
+                    int indices[2] = {block, block};
+                    handles.clear();
+                    vector<Reference*>* references =
+                        read_references(items, ref_chr_id, indices, handles);
+                    reference = (*references)[0];
+                    delete references;
+                    column = reference->select(ref_pos -
+                                               reference->get_chr_pos());
+                }
+            }
+            if (ref_base && inf_base && (block != -1))
             {
-                if (it->second.second > max)
+                // Continue the informant block if this base follows its
+                // last one in the same reference block
+                if ((current.bits != NULL) &&
+                    ((current.block != block) ||
+                     (current.chr_pos + current.bases_count != inf_pos)))
                 {
-                    max = it->second.second;
-                    to_erase = it->first;
+                    new_blocks[make_pair(ref_chr_id, current.block)].push_back(
+                        new Informant(current.bits, current.chr_id,
+                                      current.chr_pos, current.strand,
+                                      current.bases_count, current.seq_pos));
+                    current.bits = NULL;
                 }
+                if (current.bits == NULL)
+                {
+                    current.bits = new BitVector();
+                    current.block = block;
+                    current.chr_id = inf_chr_map[inf.chr].first;
+                    current.strand = inf.strand;
+                    current.chr_pos = inf_pos;
+                    current.seq_pos = column;
+                    current.bases_count = 0;
+                }
+                while (current.seq_pos + current.bits->size() < column)
+                    current.bits->push_back(false);
+                current.bits->push_back(true);
+                ++current.bases_count;
             }
-            delete cache_[to_erase].first;
-            cache_.erase(to_erase);
+            if (ref_base) ++ref_pos;
+            if (inf_base) ++inf_pos;
+        }
+        if (current.bits != NULL)
+        {
+            new_blocks[make_pair(ref_chr_id, current.block)].push_back(
+                new Informant(current.bits, current.chr_id, current.chr_pos,
+                              current.strand, current.bases_count,
+                              current.seq_pos));
         }
-        cache_.insert(make_pair(pointer, make_pair(reference, 0)));
     }
+    if (inf_name.empty())
+    {
+        throw std::runtime_error("No alignment with " + ref_name + " in " +
+                                 string(maf_fname));
+    }
+    
+    // Blocks of a reference block must be ordered and must not overlap
+    int overlapping = 0;
+    for (auto it = new_blocks.begin(); it != new_blocks.end(); ++it)
+    {
+        vector<Informant*> &blocks = it->second;
+        std::stable_sort(blocks.begin(), blocks.end(), precedes);
+        unsigned kept = 0;
+        for (unsigned i = 0; i < blocks.size(); ++i)
+        {
+            if ((kept > 0) && (blocks[i]->get_seq_pos() <
+                 blocks[kept-1]->get_seq_pos() + blocks[kept-1]->length()))
+            {
+                delete blocks[i];
+                ++overlapping;
+                continue;
+            }
+            blocks[kept++] = blocks[i];
+        }
+        blocks.resize(kept);
+    }
+    if (overlapping > 0)
+    {
+        std::cerr << "Skipped " << overlapping << " informant blocks "
+            "overlapping other ones." << std::endl;
+    }
+    
+    bioid_t inf_id = genome_map.size();
+    append_supplements(inf_id, new_blocks, index);
+    for (auto it = new_blocks.begin(); it != new_blocks.end(); ++it)
+    {
+        vector<Informant*> &blocks = it->second;
+        if (!blocks.empty() && has_summaries_)
+        {
+            index[it->first.first][it->first.second]->get_summaries()
+                .push_back(BlockSummary(inf_id, blocks.begin(),
+                                        blocks.end() - 1));
+        }
+        // Each new block may have aligned bases
+        if (!blocks.empty() && has_coverage_)
+        {
+            BitVector* &bits = coverage_[make_pair(it->first.first, inf_id)];
+            if (bits == NULL)
+                bits = new BitVector(index[it->first.first].size());
+            bits->set(it->first.second);
+        }
+        for (auto inf = blocks.begin(); inf != blocks.end(); ++inf)
+            delete *inf;
+    }
+    genome_map[inf_name] = inf_id;
+    chr_maps.push_back(inf_chr_map);
+    write_header(header_fname_, genome_map, chr_maps, index);
 }
 
-Reference* IOHandler::get_from_cache(uint64_t pointer)
+// Append supplement records with the new blocks of informant 'inf_id' to
+// the BGZF/BIN file (or the shards) and list them in the index
+void IOHandler::append_supplements(bioid_t inf_id,
+                                   map < pair<bioid_t, int>,
+                                   vector<Informant*> > &new_blocks,
+                                   map <bioid_t, vector <IndexItem*> > &index)
 {
-    if (cache_.count(pointer) > 0)
+    map < int, vector< pair<bioid_t, int> > > shard_blocks;
+    for (auto it = new_blocks.begin(); it != new_blocks.end(); ++it)
     {
-        return cache_[pointer].first;
+        if (it->second.empty()) continue;
+        int shard = 0;
+        if (!chr_shards_.empty()) shard = chr_shards_[it->first.first];
+        shard_blocks[shard].push_back(it->first);
     }
-    else return NULL;
-}
\ No newline at end of file
+    for (auto it = shard_blocks.begin(); it != shard_blocks.end(); ++it)
+    {
+        // Write the records to a new file, which is then appended;
+        // pointers to it are shifted by the size of the original file
+        string fname = shard_fnames_[it->first];
+        ifstream original(fname.c_str(), std::ios::in | std::ios::binary);
+        original.seekg(0, std::ios::end);
+        uint64_t offset = original.tellg();
+        original.close();
+        if (compressed_) offset <<= 16;
+        string tmp_fname = fname + ".tmp";
+        BGZF* bgzf = NULL;
+        std::ofstream bin;
+        open_output(tmp_fname, bgzf, bin);
+        vector< pair<uint64_t, uint64_t> > written;
+        for (auto key = it->second.begin(); key != it->second.end(); ++key)
+        {
+            vector< pair<bioid_t, vector<Informant*>*> > infs(1,
+                make_pair(inf_id, &new_blocks[*key]));
+            string record;
+            put_informants_v2(record, infs);
+            written.push_back(make_pair(write_output(record, bgzf, bin,
+                                                     tmp_fname),
+                                        record.size()));
+        }
+        close_output(bgzf, bin);
+        ifstream records(tmp_fname.c_str(), std::ios::in | std::ios::binary);
+        std::ofstream out(fname.c_str(), std::ios::out | std::ios::binary |
+                          std::ios::app);
+        out << records.rdbuf();
+        out.close();
+        records.close();
+        std::remove(tmp_fname.c_str());
+        if (out.fail()) throw std::runtime_error("Unwritable file " + fname);
+        for (unsigned i = 0; i < written.size(); ++i)
+        {
+            pair<bioid_t, int> key = it->second[i];
+            index[key.first][key.second]->add_supplement(
+                written[i].first + offset, written[i].second);
+        }
+    }
+}
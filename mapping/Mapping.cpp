@@ -1,4 +1,5 @@
 #include <map>
+#include <algorithm>
 #include <string>
 #include <vector>
 #include <utility>
@@ -20,12 +21,13 @@ using std::make_pair;
 
 
 Mapping::Mapping(IOHandler* ioh, string &informant, int inf_maxgap,
-                 int ref_maxgap, bool inner, bool alwaysmap,
+                 int ref_maxgap, bool inner, bool alwaysmap, bool sparse,
                  map < string, bioid_t > *genome_map,
                  vector < map < string, pair <bioid_t, seqpos_t> > > *chr_maps,
                  map <bioid_t, vector<IndexItem*> > *index):
     ioh_(ioh), informant_(informant), inf_maxgap_(inf_maxgap),
     ref_maxgap_(ref_maxgap), inner_(inner), alwaysmap_(alwaysmap),
+    sparse_(sparse), sparse_query_(false),
     genome_map_(genome_map), chr_maps_(chr_maps), index_(index)
 {
     inf_id_ = (*genome_map)[informant];
@@ -40,6 +42,7 @@ Mapping::Mapping(IOHandler* ioh, string &informant, int inf_maxgap,
     answer_ = NULL;
     thick_answer_ = NULL;
     references_ = NULL;
+    inf_array_ = NULL;
 }
 
 Mapping::~Mapping()
@@ -50,16 +53,18 @@ Mapping::~Mapping()
 
 void Mapping::delete_old()
 {
+    query_peak_bytes_ = std::max(query_peak_bytes_, query_bytes());
     if (references_ != NULL)
     {
         delete references_;
         references_ = NULL;
     }
+    pinned_.clear();
     if ((thick_answer_ != NULL) && (thick_answer_ != answer_))
     {
         delete thick_answer_;
-        thick_answer_ = NULL;
     }
+    thick_answer_ = NULL;
     if (answer_ != NULL)
     {
         delete answer_;
@@ -67,6 +72,7 @@ void Mapping::delete_old()
     }
     for (auto it = exons_.begin(); it != exons_.end(); ++it) delete (*it);
     exons_.clear();
+    endpoints_.clear();
 }
 
 string Mapping::get_error_message(string error_name)
@@ -85,16 +91,83 @@ string Mapping::get_error_message(string error_name)
     return "";
 }
 
-void Mapping::print_errors()
+// Print errors of the last query, 'prefix' precedes each line
+void Mapping::print_errors(const string &prefix /*=""*/)
 {
-    std::cerr << query_->get_name() << " ";
+    std::cerr << prefix << query_->get_name() << " ";
     for (auto it = errors_.begin(); it != errors_.end(); ++it)
     {
+        if (it != errors_.begin()) std::cerr << prefix;
         std::cerr << *it << " " << get_error_message(*it) << std::endl;
     }
     errors_.clear();
 }
 
+// Return index of the first error of the last query in the known errors
+// plus 1, 0 if it has none and -1 if it is not known
+int Mapping::get_error_code()
+{
+    if (errors_.empty()) return 0;
+    for (int i = 0; i < known_error_count_; ++i)
+    {
+        if (errors_[0].compare(known_error_names_[i]) == 0) return i + 1;
+    }
+    return -1;
+}
+
+vector<string> Mapping::get_error_names()
+{
+    return vector<string>(known_error_names_,
+                          known_error_names_ + known_error_count_);
+}
+
+// Bytes taken by structures of the current query: its endpoints, summaries
+// of their blocks, the list of its blocks and its answers
+uint64_t Mapping::query_bytes()
+{
+    uint64_t bytes = endpoints_.size() * sizeof(MappedPosition) +
+                     pieces_.size() * sizeof(BlockSummary) +
+                     exons_.size() * sizeof(BedQuery);
+    for (auto it = endpoints_.begin(); it != endpoints_.end(); ++it)
+        bytes += it->error.capacity();
+    if (references_ != NULL)
+    {
+        bytes += sizeof(vector<Reference*>) +
+                 references_->capacity() * sizeof(Reference*);
+    }
+    bytes += pinned_.size() * sizeof(ReferenceHandle);
+    if (answer_ != NULL)
+    {
+        bytes += sizeof(BedQuery) + 2 * sizeof(seqpos_t) *
+                 answer_->get_exon_count();
+    }
+    if ((thick_answer_ != NULL) && (thick_answer_ != answer_))
+        bytes += sizeof(BedQuery);
+    return bytes;
+}
+
+// Print the most bytes taken by one query and bytes taken by remembered
+// endpoints
+void Mapping::print_memory(const string &prefix /*=""*/)
+{
+    uint64_t memo_bytes = memo_.bucket_count() * sizeof(void*) +
+        memo_.size() * (sizeof(*memo_.begin()) + 2 * sizeof(void*)) +
+        memo_order_.size() * sizeof(EndpointKey);
+    std::cerr << prefix << "Memory: query peak " << query_peak_bytes_
+              << " bytes, endpoint memo " << memo_bytes << " bytes"
+              << std::endl;
+}
+
+// Print how often mapped endpoints were reused from previous queries
+void Mapping::print_stats(const string &prefix /*=""*/)
+{
+    uint64_t lookups = memo_hits_ + memo_misses_;
+    std::cerr << prefix << "Endpoint cache: " << memo_hits_ << " hits, "
+              << memo_misses_ << " misses ("
+              << (lookups > 0 ? 100.0 * memo_hits_ / lookups : 0)
+              << "% hit rate)" << std::endl;
+}
+
 // Set one error and throw exception
 void Mapping::error(string error_name /*=""*/)
 {
@@ -120,11 +193,11 @@ seqpos_t Mapping::max(seqpos_t x, seqpos_t y)
     return y;
 }
 
-// Return references containing given positions
-vector<Reference*>* Mapping::get_references(seqpos_t start, seqpos_t end)
+// Find indices of blocks containing given positions
+void Mapping::find_blocks(seqpos_t start, seqpos_t end, int indices[])
 {
     seqpos_t lo = 0, hi = (*index_)[ref_chr_id_].size(), mid;
-    int indices[2] = {-1, -1};
+    indices[0] = indices[1] = -1;
     seqpos_t queries[2] = {start, end};
     for (int i = 0; i < 2; ++i)
     {
@@ -147,280 +220,551 @@ vector<Reference*>* Mapping::get_references(seqpos_t start, seqpos_t end)
         lo = indices[i];
         hi = (*index_)[ref_chr_id_].size();
     }
-    return ioh_->read_references((*index_)[ref_chr_id_], ref_chr_id_, indices);
+    // Both ends of an interval in one block without aligned bases can not be
+    // mapped, the search for the nearest aligned base would leave the block
+    if ((indices[0] == indices[1]) &&
+        ioh_->is_unaligned(ref_chr_id_, inf_id_, indices[0]))
+    {
+        error("pos_to_gap");
+    }
 }
 
-// Fill 'informants' by all informants belonging to references in 'references'
-void Mapping::fill_informant_vector(vector<Reference*> &references,
-                                    vector<Informant*> &informants)
+// Return references of blocks indices[0] .. indices[1]
+vector<Reference*>* Mapping::get_references(int indices[])
 {
-    for (auto ref_it = references.begin(); ref_it != references.end(); ++ref_it)
-    {
-        for (auto inf_it = (*ref_it)->get_informant_vector(inf_id_)->begin();
-            inf_it != (*ref_it)->get_informant_vector(inf_id_)->end(); ++inf_it)
-        {
-            informants.push_back(*inf_it);
-        }
-    }
+    first_block_ = indices[0];
+    return ioh_->read_references((*index_)[ref_chr_id_], ref_chr_id_, indices,
+                                 pinned_);
 }
 
-// Get number of informants belonging to references from 'from' to 'to'
-seqpos_t Mapping::get_inf_count(vector<Reference*>::iterator &from,
-                                const vector<Reference*>::iterator &to)
+// Map one position from reference to informant, starting the search in the
+// reference 'mapped.ref_it'; 'seg_cursor' is the segment cursor of that
+// reference
+void Mapping::map_position(vector<Reference*> &references,
+                           MappedPosition &mapped, unsigned &seg_cursor)
 {
-    seqpos_t overall_inf_index = 0;
-    while (from != to)
-    {
-        overall_inf_index += (*from)->get_informant_vector(inf_id_)->size();
-        ++from;
-    }
-    return overall_inf_index;
+    if (mapped.way == 1) map_position<1>(references, mapped, seg_cursor);
+    else map_position<-1>(references, mapped, seg_cursor);
 }
 
-// Map one position from reference to informant
-BedQuery* Mapping::map_position(vector<Reference*> &references,
-                                vector<Informant*> &informants,
-                                seqpos_t position, int way,
-                                vector<Reference*>::iterator &ref_it,
-                                vector<Informant*>::iterator &inf_it_ret)
+// Map one position searching in direction 'way', which is fixed at compile
+// time, so that the searches do not test it
+template <int way>
+void Mapping::map_position(vector<Reference*> &references,
+                           MappedPosition &mapped, unsigned &seg_cursor)
 {
-    position -= (*ref_it)->get_chr_pos();
-    // Find index of position-th '1' in references
-    seqpos_t seq_pos = (*ref_it)->select(position);
-    // Find instance of Informant in which is position corresponding to seq_pos
-    seqpos_t inf_index;
-    int gap = 0;
-    while (!((*ref_it)->find_informant(inf_index, inf_id_, seq_pos, way)))
-    {
-        if (way == 1)
-        {
-            gap += (*ref_it)->length() - seq_pos;
-            ++ref_it;
-            if (ref_it == references.end()) error("pos_to_gap");
-            seq_pos = 0;
-        }
-        else
-        {
-            if (ref_it == references.begin()) error("pos_to_gap");
-            gap += seq_pos;
-            --ref_it;
-            seq_pos = (*ref_it)->length() - 1;
-        }
-        if (gap > ref_maxgap_) error("ref_gap");
-    }
-    auto ref_begin = references.begin();
-    inf_index += get_inf_count(ref_begin, ref_it);
-    vector<Informant*>::iterator inf_it = informants.begin() + inf_index;
-    // Find '1' in inf. sequence corresponding to given '1' in ref.
-    int jinf;
-    if (way == 1) jinf = max(0, seq_pos - (*inf_it)->get_seq_pos());
-    else jinf = min((*inf_it)->length() - 1,
-                    seq_pos - (*inf_it)->get_seq_pos());
-    int jref = (*inf_it)->get_seq_pos() + jinf;
-    Reference* ref = (*inf_it)->get_ref();
-    while (!((*inf_it)->find_aligned_one(way, jinf, jref)))
+    seqpos_t position = mapped.position;
+    vector<Reference*>::iterator ref_it = mapped.ref_it;
+    // Find the ungapped segment containing position, or the nearest one
+    // in direction 'way' within the same reference
+    vector<Reference*>::iterator seg_ref_it = ref_it;
+    unsigned seg_index;
+    if (!((*ref_it)->find_segment<way>(seg_index, inf_id_, position,
+                                       seg_cursor)))
     {
-        if (jinf >= (*inf_it)->length())
+        // Find index of position-th '1' in references
+        seqpos_t seq_pos = (*ref_it)->select(max(0, position -
+                                                 (*ref_it)->get_chr_pos()));
+        // Find instance of Informant in which is position corresponding
+        // to seq_pos
+        seqpos_t inf_index;
+        seqpos_t gap = 0;
+        bool moved = false;
+        while (!((*ref_it)->find_informant<way>(inf_index, inf_id_, seq_pos)))
         {
-            if (inf_it != informants.end()) ++inf_it;
-            else error("pos_to_gap");
-            if (ref->get_chr_pos() != ((*inf_it)->get_ref())->get_chr_pos())
+            if (way == 1)
             {
-                ref = (*inf_it)->get_ref();
-                jref = 0;
+                gap += (*ref_it)->length() - seq_pos;
+                ++ref_it;
+                if (ref_it == references.end())
+                    throw MappingError("pos_to_gap");
+                seq_pos = 0;
             }
-            jinf = 0;
+            else
+            {
+                if (ref_it == references.begin())
+                    throw MappingError("pos_to_gap");
+                gap += seq_pos;
+                --ref_it;
+                seq_pos = (*ref_it)->length() - 1;
+            }
+            if (gap > ref_maxgap_)
+            {
+                mapped.gap = gap;
+                throw MappingError("ref_gap");
+            }
+            moved = true;
         }
-        if (jinf < 0)
+        // The nearest aligned base lies in the first reference (in direction
+        // 'way') which has any segment
+        seg_ref_it = ref_it;
+        if (!moved || (*seg_ref_it)->get_segments(inf_id_)->empty())
         {
-            if (inf_it == informants.begin()) error("pos_to_gap");
-            --inf_it;
-            if (ref->get_chr_pos() != ((*inf_it)->get_ref())->get_chr_pos())
+            do
             {
-                ref = (*inf_it)->get_ref();
-                jref = ref->length() - 1;
+                if (way == 1)
+                {
+                    ++seg_ref_it;
+                    if (seg_ref_it == references.end())
+                        throw MappingError("pos_to_gap");
+                }
+                else
+                {
+                    if (seg_ref_it == references.begin())
+                        throw MappingError("pos_to_gap");
+                    --seg_ref_it;
+                }
             }
-            jinf = (*inf_it)->length() - 1;
+            while ((*seg_ref_it)->get_segments(inf_id_)->empty());
         }
+        if (way == 1) seg_index = 0;
+        else seg_index = (*seg_ref_it)->get_segments(inf_id_)->size() - 1;
     }
-    // Find order of the '1' on jinf-th positon
-    seqpos_t inf_pos = (*inf_it)->rank(jinf);
-    inf_it_ret = inf_it;
-    BedQuery* ret = new BedQuery(*query_,
-                                 (*id_to_len_)[(*inf_it)->get_chr_id()].first,
-                                 (*inf_it)->get_strand(),
-                                 (*id_to_len_)[(*inf_it)->get_chr_id()].second,
-                                 inf_pos);
-    return ret;
+    Segment &segment = (*(*seg_ref_it)->get_segments(inf_id_))[seg_index];
+    // Position of the corresponding base, or of the nearest aligned one
+    if (position < segment.ref_pos) mapped.inf_pos = segment.inf_pos;
+    else if (position >= segment.ref_pos + segment.length)
+        mapped.inf_pos = segment.inf_pos + segment.length - 1;
+    else mapped.inf_pos = segment.inf_pos + position - segment.ref_pos;
+    mapped.inf_block = first_block_ + (seg_ref_it - references.begin());
+    mapped.inf_index = segment.inf_index;
+    mapped.inf_it = inf_array_->get_block(mapped.inf_block) + segment.inf_index;
+    mapped.chr_id = (*mapped.inf_it)->get_chr_id();
+    mapped.strand = (*mapped.inf_it)->get_strand();
 }
 
 // Check if given informants are correctly preceeding each other
-bool Mapping::check_informants(vector<Informant*>::iterator &inf_it1,
-                               vector<Informant*>::iterator &inf_it2)
+bool Mapping::check_informants(vector<Informant*>::iterator inf_it1,
+                               vector<Informant*>::iterator inf_it2,
+                               int inf_maxgap)
 {
     if (inf_it1 > inf_it2)
     {
         errors_.push_back("inf_preceed");
         return false;
     }
-    seqpos_t last_inf_end, last_ref_end;
-    bool last_strand;
-    bioid_t last_chr_id;
+    BlockSummary last(inf_id_, inf_it1, inf_it1);
     while (inf_it1 != inf_it2)
     {
-        last_inf_end = (*inf_it1)->get_chr_pos() +\
-            (*inf_it1)->get_bases_count();
-        last_ref_end = (*inf_it1)->get_seq_pos() +\
-            (*inf_it1)->get_bases_count();
-        last_strand = (*inf_it1)->get_strand();
-        last_chr_id = (*inf_it1)->get_chr_id();
         ++inf_it1;
-        
-        if ((last_inf_end > (*inf_it1)->get_chr_pos()) ||
-            (last_strand != (*inf_it1)->get_strand()) ||
-            (last_chr_id != (*inf_it1)->get_chr_id()) ||
-            ((inf_maxgap_ > -1) &&
-             ((*inf_it1)->get_chr_pos() - last_inf_end > inf_maxgap_)) ||
-            ((ref_maxgap_ > -1) &&
-             ((*inf_it1)->get_seq_pos() - last_ref_end > ref_maxgap_)))
+        BlockSummary next(inf_id_, inf_it1, inf_it1);
+        if (!check_step(last, next, inf_maxgap)) return false;
+        last = next;
+    }
+    return true;
+}
+
+// Check if the last informant summarized by 'last' correctly preceeds the
+// first one summarized by 'next'
+bool Mapping::check_step(const BlockSummary &last, const BlockSummary &next,
+                         int inf_maxgap)
+{
+    seqpos_t inf_gap = next.first_chr_pos - last.last_inf_end;
+    seqpos_t ref_gap = next.first_seq_pos - last.last_ref_end;
+    if ((inf_gap < 0) || (last.strand != next.strand) ||
+        (last.chr_id != next.chr_id) ||
+        ((inf_maxgap > -1) && (inf_gap > inf_maxgap)) ||
+        ((ref_maxgap_ > -1) && (ref_gap > ref_maxgap_)))
+    {
+        if (inf_gap < 0) errors_.push_back("inf_preceed");
+        if (last.strand != next.strand) errors_.push_back("inf_strand");
+        if (last.chr_id != next.chr_id) errors_.push_back("inf_contig");
+        if ((inf_maxgap > -1) && (inf_gap > inf_maxgap))
         {
-            if (last_inf_end > (*inf_it1)->get_chr_pos())
-                errors_.push_back("inf_preceed");
-            if (last_strand != (*inf_it1)->get_strand())
-                errors_.push_back("inf_strand");
-            if (last_chr_id != (*inf_it1)->get_chr_id())
-                errors_.push_back("inf_contig");
-            if ((inf_maxgap_ > -1) &&
-                ((*inf_it1)->get_chr_pos() - last_inf_end > inf_maxgap_))
-            {
-                errors_.push_back("inf_gap");
-                found_gap_ = (*inf_it1)->get_chr_pos() - last_inf_end;
-            }
-            if ((ref_maxgap_ > -1) &&
-                ((*inf_it1)->get_seq_pos() - last_ref_end > ref_maxgap_))
-            {
-                errors_.push_back("ref_gap");
-                found_gap_ = (*inf_it1)->get_seq_pos() - last_ref_end;
-            }
-            return false;
+            errors_.push_back("inf_gap");
+            found_gap_ = inf_gap;
         }
+        if ((ref_maxgap_ > -1) && (ref_gap > ref_maxgap_))
+        {
+            errors_.push_back("ref_gap");
+            found_gap_ = ref_gap;
+        }
+        return false;
     }
     return true;
 }
 
-// Get a mapping of the given interval
-BedQuery* Mapping::get_mapping(seqpos_t start, seqpos_t end,
-                               vector <Reference*> &references,
-                               vector<Informant*> &informants,
-                               vector<Reference*>::iterator &ref_it1,
-                               vector<Reference*>::iterator &ref_it2)
-{    
-    if (start > end) error("invalid_query");
-    // Get mapping of two positions
-    vector<Informant*>::iterator inf_it1;
-    vector<Informant*>::iterator inf_it2;
+// Queue mapping of both ends of the given interval
+void Mapping::add_endpoints(seqpos_t start, seqpos_t end)
+{
     int way = 1;
     if (!inner_) way = -1;
-    answer_ = map_position(references, informants, start, way,
-                                     ref_it1, inf_it1);
-    BedQuery *answer2 = map_position(references, informants, end, (-1) * way,
-                                     ref_it2, inf_it2);
+    endpoints_.push_back(MappedPosition(start, way, false));
+    endpoints_.push_back(MappedPosition(end, (-1) * way, true));
+}
+
+// Map all queued endpoints in one sweep over references in ascending order
+// of position. An interval starts in the first reference ending after its
+// start and ends in the last reference beginning at or before its end.
+void Mapping::map_endpoints()
+{
+    vector< pair<seqpos_t, unsigned> > order;
+    for (unsigned i = 0; i < endpoints_.size(); ++i)
+        order.push_back(make_pair(endpoints_[i].position, i));
+    std::sort(order.begin(), order.end());
     
-    // Check if the positions make up an interval
-    bool merged = answer_->merge_query(answer2, query_->get_strand());
+    vector<Reference*>::iterator ref_it = references_->begin();
+    vector<Reference*>::iterator seg_ref_it = references_->end();
+    unsigned seg_cursor = 0;
+    MappedPosition *last = NULL;
+    for (auto it = order.begin(); it != order.end(); ++it)
+    {
+        MappedPosition &mapped = endpoints_[it->second];
+        // The same position is often shared by several intervals
+        if ((last != NULL) && (last->position == mapped.position) &&
+            (last->way == mapped.way) && (last->is_end == mapped.is_end))
+        {
+            mapped = *last;
+            continue;
+        }
+        last = &mapped;
+        while ((ref_it != references_->end()) &&
+               ((*ref_it)->get_chr_pos() + (*ref_it)->get_bases_count() <=
+                mapped.position))
+        {
+            ++ref_it;
+        }
+        if (!mapped.is_end)
+        {
+            if (ref_it == references_->end()) continue;
+            mapped.ref_it = ref_it;
+        }
+        else if ((ref_it != references_->end()) &&
+                 ((*ref_it)->get_chr_pos() <= mapped.position))
+        {
+            mapped.ref_it = ref_it;
+        }
+        else
+        {
+            if (ref_it == references_->begin()) continue;
+            mapped.ref_it = ref_it - 1;
+        }
+        mapped.located = true;
+        mapped.ref_block = first_block_ +
+                           (mapped.ref_it - references_->begin());
+        if (mapped.ref_it != seg_ref_it)
+        {
+            seg_ref_it = mapped.ref_it;
+            seg_cursor = 0;
+        }
+        // A remembered mapping holds if the block of its informant is
+        // loaded, the search would have found it the same way
+        EndpointKey key = {ref_chr_id_, mapped.position, mapped.way,
+                           mapped.is_end};
+        auto memo = memo_.find(key);
+        if ((memo != memo_.end()) &&
+            (memo->second.inf_block >= first_block_) &&
+            (memo->second.inf_block <
+             first_block_ + (int)references_->size()))
+        {
+            ++memo_hits_;
+            mapped.inf_pos = memo->second.inf_pos;
+            mapped.chr_id = memo->second.chr_id;
+            mapped.strand = memo->second.strand;
+            mapped.inf_block = memo->second.inf_block;
+            mapped.inf_index = memo->second.inf_index;
+            mapped.inf_it = inf_array_->get_block(mapped.inf_block) +
+                            mapped.inf_index;
+            continue;
+        }
+        ++memo_misses_;
+        try
+        {
+            map_position(*references_, mapped, seg_cursor);
+            memoize(key, mapped);
+        }
+        catch (MappingError &e)
+        {
+            mapped.error = e.what();
+        }
+    }
+}
+
+// Remember a successfully mapped endpoint, forget the oldest one if there
+// are too many
+void Mapping::memoize(const EndpointKey &key, MappedPosition &mapped)
+{
+    if (memo_.count(key) > 0) return;
+    if (memo_.size() >= memo_size_)
+    {
+        memo_.erase(memo_order_.front());
+        memo_order_.pop_front();
+    }
+    memo_.insert(make_pair(key, mapped));
+    memo_order_.push_back(key);
+}
+
+// Get a mapping of the interval given by endpoints first and first+1, NULL
+// if the summaries of blocks in the sparse mode do not tell it
+BedQuery* Mapping::get_mapping(unsigned first, int inf_maxgap,
+                               string location_error)
+{
+    MappedPosition &start = endpoints_[first], &end = endpoints_[first+1];
+    if (!start.located || !end.located || (start.ref_block > end.ref_block))
+        error(location_error);
+    if (start.position > end.position) error("invalid_query");
+    if (start.error.compare("") != 0)
+    {
+        found_gap_ = start.gap;
+        error(start.error);
+    }
+    if (end.error.compare("") != 0)
+    {
+        found_gap_ = end.gap;
+        error(end.error);
+    }
+    BedQuery *answer = merge_endpoints(start, end);
+    if (answer == NULL) error("no_mapping");
+    int valid = 1;
+    if (sparse_query_) valid = check_pieces(first, inf_maxgap);
+    else if (!check_informants(start.inf_it, end.inf_it, inf_maxgap)) valid = 0;
+    if (valid != 1)
+    {
+        delete answer;
+        if (valid == 0) error();
+        return NULL;
+    }
+    return answer;
+}
+
+// Get the interval between mapped endpoints, NULL if they do not make up one
+BedQuery* Mapping::merge_endpoints(MappedPosition &start, MappedPosition &end)
+{
+    BedQuery *answer1 = new BedQuery(*query_,
+                                     (*id_to_len_)[start.chr_id].first,
+                                     start.strand,
+                                     (*id_to_len_)[start.chr_id].second,
+                                     start.inf_pos);
+    BedQuery *answer2 = new BedQuery(*query_,
+                                     (*id_to_len_)[end.chr_id].first,
+                                     end.strand,
+                                     (*id_to_len_)[end.chr_id].second,
+                                     end.inf_pos);
+    bool merged = answer1->merge_query(answer2, query_->get_strand());
     delete answer2;
-    if (!merged) error("no_mapping");
-    if (!check_informants(inf_it1, inf_it2)) error();
-    return answer_;
+    if (merged) return answer1;
+    delete answer1;
+    return NULL;
+}
+
+// Whether informants summarized by 'summary' correctly preceed each other
+bool Mapping::is_valid(const BlockSummary &summary, int inf_maxgap)
+{
+    return summary.ordered &&
+           ((inf_maxgap <= -1) || (summary.max_inf_gap <= inf_maxgap)) &&
+           ((ref_maxgap_ <= -1) || (summary.max_ref_gap <= ref_maxgap_));
 }
 
-// Sets given iterators such that corresponding Reference-s contain start, end
-void Mapping::set_ref_iterators(seqpos_t start, seqpos_t end,
-                                vector<Reference*> &references,
-                                vector<Reference*>::iterator &ref_it1,
-                                vector<Reference*>::iterator &ref_it2)
+// Map the queued endpoints decoding only the blocks (from indices[0] ..
+// indices[1]) they lie in, each block on its own. Return false if some
+// endpoint does not map within its block.
+bool Mapping::map_sparse_endpoints(int indices[])
 {
-    while (((*ref_it1)->get_chr_pos() +
-            (*ref_it1)->get_bases_count() <= start) ||
-           ((*ref_it2)->get_chr_pos() > end))
+    vector<IndexItem*> &items = (*index_)[ref_chr_id_];
+    map <int, vector<unsigned> > block_endpoints;
+    for (unsigned i = 0; i < endpoints_.size(); ++i)
     {
-        if ((*ref_it1)->get_chr_pos() + (*ref_it1)->get_bases_count() <= start)
-            ++ref_it1;
-        if ((*ref_it2)->get_chr_pos() > start)
-            --ref_it2;
-        if ((ref_it1 == references.end()) || ((ref_it2 == references.begin()) &&
-             ((*ref_it2)->get_chr_pos() > start)) || (ref_it1 > ref_it2))
+        // The same block as in map_endpoints: the first one ending after
+        // the position, or the one before it for an end outside of it
+        MappedPosition &mapped = endpoints_[i];
+        int lo = indices[0], hi = indices[1] + 1;
+        while (lo < hi)
         {
-            error("no_thick_mapping");
+            int mid = (lo + hi) / 2;
+            if (items[mid]->get_chr_pos() + items[mid]->get_bases_count() <=
+                mapped.position)
+            {
+                lo = mid + 1;
+            }
+            else hi = mid;
+        }
+        if (!mapped.is_end)
+        {
+            if (lo > indices[1]) continue;
+        }
+        else if ((lo > indices[1]) ||
+                 (items[lo]->get_chr_pos() > mapped.position))
+        {
+            if (lo == indices[0]) continue;
+            --lo;
         }
-    }  
+        mapped.located = true;
+        mapped.ref_block = lo;
+        block_endpoints[lo].push_back(i);
+    }
+    
+    pieces_.assign(endpoints_.size(), BlockSummary());
+    for (auto it = block_endpoints.begin(); it != block_endpoints.end(); ++it)
+    {
+        int block[2] = {it->first, it->first};
+        vector<Reference*>* references = get_references(block);
+        inf_array_ = ioh_->get_informant_array(ref_chr_id_, inf_id_,
+                                               *references, first_block_);
+        bool mapped_all = true;
+        for (auto i = it->second.begin(); mapped_all && (i != it->second.end());
+             ++i)
+        {
+            endpoints_[*i].ref_it = references->begin();
+            unsigned seg_cursor = 0;
+            try
+            {
+                map_position(*references, endpoints_[*i], seg_cursor);
+            }
+            catch (MappingError &e)
+            {
+                mapped_all = false;
+            }
+        }
+        // Informants of the block up to the other endpoint of the interval
+        // or to the end of the block
+        vector<Informant*>* informants =
+            references->front()->get_informant_vector(inf_id_);
+        for (auto i = it->second.begin(); mapped_all && (i != it->second.end());
+             ++i)
+        {
+            MappedPosition &mapped = endpoints_[*i];
+            MappedPosition &other = endpoints_[*i ^ 1];
+            auto from = informants->begin(), to = informants->end() - 1;
+            if (!mapped.is_end) from += mapped.inf_index;
+            else to = informants->begin() + mapped.inf_index;
+            if (other.located && (other.ref_block == it->first))
+            {
+                if (!mapped.is_end) to = informants->begin() + other.inf_index;
+                else from = informants->begin() + other.inf_index;
+            }
+            if (from <= to) pieces_[*i] = BlockSummary(inf_id_, from, to);
+        }
+        delete references;
+        if (!mapped_all) return false;
+    }
+    return true;
 }
 
-// Get mapping of a given BED line - interval, thick interval and exons
-BedQuery* Mapping::get_answer()
+// Check informants between endpoints first and first+1 mapped in the sparse
+// mode: pieces of their blocks and summaries of the blocks between. Return
+// 1 if they are valid, 0 if not and -1 if the first wrong pair of
+// informants could lie inside a block.
+int Mapping::check_pieces(unsigned first, int inf_maxgap)
+{
+    MappedPosition &start = endpoints_[first], &end = endpoints_[first+1];
+    if (start.inf_block == end.inf_block)
+    {
+        if (start.inf_index > end.inf_index)
+        {
+            errors_.push_back("inf_preceed");
+            return 0;
+        }
+        return is_valid(pieces_[first], inf_maxgap) ? 1 : -1;
+    }
+    if (!is_valid(pieces_[first], inf_maxgap)) return -1;
+    BlockSummary* last = &pieces_[first];
+    for (int block = start.inf_block + 1; block < end.inf_block; ++block)
+    {
+        BlockSummary* summary =
+            (*index_)[ref_chr_id_][block]->find_summary(inf_id_);
+        if (summary == NULL) continue;
+        if (!check_step(*last, *summary, inf_maxgap)) return 0;
+        if (!is_valid(*summary, inf_maxgap)) return -1;
+        last = summary;
+    }
+    if (!check_step(*last, pieces_[first+1], inf_maxgap)) return 0;
+    return is_valid(pieces_[first+1], inf_maxgap) ? 1 : -1;
+}
+
+// Queue endpoints of the interval, the thick interval and exons
+void Mapping::add_query_endpoints(bool thick)
+{
+    add_endpoints(query_->get_start(), query_->get_end());
+    if (thick)
+        add_endpoints(query_->get_thick_start(), query_->get_thick_end());
+    for (unsigned i = 0; i < query_->get_exon_count(); ++i)
+    {
+        add_endpoints(query_->get_start() + (*(query_->get_exon_starts()))[i],
+                      query_->get_start() + (*(query_->get_exon_ends()))[i]);
+    }
+}
+
+// Get mappings of the interval, the thick interval and exons from mapped
+// endpoints. Return false if the summaries of blocks in the sparse mode do
+// not tell them.
+bool Mapping::map_intervals(bool thick)
 {
-    delete_old();
-    if ((query_ == NULL) || (query_->get_start() > query_->get_end()))
-        error("invalid_query");
-    // Get references
-    ref_chr_id_ = (*chr_maps_)[0][query_->get_chr()].first;
-    references_ = get_references(query_->get_start(),
-                                                     query_->get_end());
-    if (references_->size() == 0) error("no_mapping");
-    vector<Reference*>::iterator ref_it1 = references_->begin();
-    vector<Reference*>::iterator ref_it2 = --(references_->end());
-    vector<Informant*> informants;
-    fill_informant_vector(*references_, informants);
     // Interval
-    int imaxgap = inf_maxgap_;
-    if (query_->get_exon_count() > 0) inf_maxgap_ = -1;
-    BedQuery* answer = get_mapping(query_->get_start(), query_->get_end(),
-                                   *references_, informants, ref_it1, ref_it2);
+    int inf_maxgap = inf_maxgap_;
+    if (query_->get_exon_count() > 0) inf_maxgap = -1;
+    answer_ = get_mapping(0, inf_maxgap, "no_mapping");
+    if (answer_ == NULL) return false;
     
     // Thick interval
+    unsigned next = 2;
     if (query_->get_thick_start() != -1)
     {
-        if ((query_->get_thick_start() == query_->get_start()) &&
-            (query_->get_thick_end() == query_->get_end()))
-        {
-            thick_answer_ = answer;
-        }
+        if (!thick) thick_answer_ = answer_;
         else
         {
-            set_ref_iterators(query_->get_thick_start(),
-                              query_->get_thick_end(), *references_,
-                              ref_it1, ref_it2);
-            thick_answer_ = get_mapping(query_->get_thick_start(),
-                                       query_->get_thick_end(),
-                                       *references_, informants, ref_it1,
-                                       ref_it2);
+            thick_answer_ = get_mapping(next, inf_maxgap, "no_thick_mapping");
+            if (thick_answer_ == NULL) return false;
+            next += 2;
         }
-        answer->merge_thick(thick_answer_);
+        answer_->merge_thick(thick_answer_);
     }
     
     // Exons
     if (query_->get_exon_count() > 0)
     {
-        inf_maxgap_ = imaxgap;
-        for (unsigned i = 0; i < query_->get_exon_count(); ++i)
+        for (unsigned i = 0; i < query_->get_exon_count(); ++i, next += 2)
         {
-            ref_it1 = references_->begin();
-            ref_it2 = --(references_->end());
-            set_ref_iterators(query_->get_start() +
-                              (*(query_->get_exon_starts()))[i],
-                              query_->get_start() +
-                              (*(query_->get_exon_ends()))[i],
-                              *references_, ref_it1, ref_it2);
-            exons_.push_back(get_mapping(query_->get_start() +
-                                        (*(query_->get_exon_starts()))[i],
-                                        query_->get_start() +
-                                        (*(query_->get_exon_ends()))[i],
-                                        *references_, informants, ref_it1,
-                                        ref_it2));
+            BedQuery* exon = get_mapping(next, inf_maxgap_,
+                                         "no_thick_mapping");
+            if (exon == NULL) return false;
+            exons_.push_back(exon);
         }
-        bool merged_exons = answer->merge_exons(exons_);
+        bool merged_exons = answer_->merge_exons(exons_);
         if (!merged_exons && !alwaysmap_)
             error("no_exon_mapping");
     }
-    return answer;
-}
\ No newline at end of file
+    return true;
+}
+
+// Get mapping of a given BED line - interval, thick interval and exons
+BedQuery* Mapping::get_answer()
+{
+    delete_old();
+    if ((query_ == NULL) || (query_->get_start() > query_->get_end()))
+        error("invalid_query");
+    // A store sliced to some chromosomes numbers them from 0, so a query on
+    // any other chromosome must not fall back to id 0
+    auto chr = (*chr_maps_)[0].find(query_->get_chr());
+    if (chr == (*chr_maps_)[0].end()) error("unknown_chr");
+    ref_chr_id_ = chr->second.first;
+    int indices[2];
+    find_blocks(query_->get_start(), query_->get_end(), indices);
+    bool thick = (query_->get_thick_start() != -1) &&
+                 ((query_->get_thick_start() != query_->get_start()) ||
+                  (query_->get_thick_end() != query_->get_end()));
+    
+    // Blocks between the endpoints may not be needed for a plain interval,
+    // or for any one in the sparse mode
+    add_query_endpoints(thick);
+    sparse_query_ = (sparse_ || (!thick && (query_->get_exon_count() == 0)))
+                    && (indices[1] - indices[0] > 1) && ioh_->has_summaries();
+    if (sparse_query_)
+    {
+        if (map_sparse_endpoints(indices) && map_intervals(thick))
+            return answer_;
+        sparse_query_ = false;
+        delete_old();
+        add_query_endpoints(thick);
+    }
+    
+    // Get references
+    references_ = get_references(indices);
+    if (references_->size() == 0) error("no_mapping");
+    inf_array_ = ioh_->get_informant_array(ref_chr_id_, inf_id_, *references_,
+                                           first_block_);
+    
+    // Map endpoints of the interval, the thick interval and exons at once
+    map_endpoints();
+    map_intervals(thick);
+    return answer_;
+}
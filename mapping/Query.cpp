@@ -1,6 +1,8 @@
 #include <string>
 #include <sstream>
 #include <vector>
+#include <utility>
+#include <algorithm>
 
 #include <iostream>
 
@@ -10,6 +12,8 @@ using std::string;
 using std::to_string;
 using std::istringstream;
 using std::vector;
+using std::pair;
+using std::make_pair;
 
 bool IndexItem::get_strand()
 {
@@ -31,6 +35,54 @@ uint64_t IndexItem::get_pointer()
     return pointer_;
 }
 
+uint64_t IndexItem::get_record_length()
+{
+    return record_length_;
+}
+
+void IndexItem::set_record_length(uint64_t record_length)
+{
+    record_length_ = record_length;
+}
+
+void IndexItem::set_pointer(uint64_t pointer)
+{
+    pointer_ = pointer;
+}
+
+vector< pair<uint64_t, uint64_t> >& IndexItem::get_supplements()
+{
+    return supplements_;
+}
+
+void IndexItem::add_supplement(uint64_t pointer, uint64_t length)
+{
+    supplements_.push_back(make_pair(pointer, length));
+}
+
+vector<BlockSummary>& IndexItem::get_summaries()
+{
+    return summaries_;
+}
+
+// Bytes taken by the item
+uint64_t IndexItem::memory_usage()
+{
+    return sizeof(IndexItem) +
+           supplements_.capacity() * sizeof(supplements_[0]) +
+           summaries_.capacity() * sizeof(BlockSummary);
+}
+
+// Return summary of the given informant, NULL if it has no bases in the block
+BlockSummary* IndexItem::find_summary(bioid_t inf_id)
+{
+    auto it = std::lower_bound(summaries_.begin(), summaries_.end(), inf_id,
+                               [](const BlockSummary &summary, bioid_t id)
+                               { return summary.inf_id < id; });
+    if ((it == summaries_.end()) || (it->inf_id != inf_id)) return NULL;
+    return &(*it);
+}
+
 // Set numbers given as string separated by ',' in given vector
 void BedQuery::set_numbers(string str, vector<seqpos_t>* numbers)
 {
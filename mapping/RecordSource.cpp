@@ -0,0 +1,102 @@
+#include <string>
+#include <fstream>
+#include <stdexcept>
+#include <cstring>
+#include <cstdio>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "include/RecordSource.h"
+
+using std::string;
+
+
+BgzfSource::BgzfSource(const string &fname): fname_(fname)
+{
+    bgzf_ = bgzf_open(fname.c_str(), "r");
+    if (bgzf_ == NULL)
+        throw std::runtime_error("Unreadable BGZF file " + fname);
+}
+
+BgzfSource::~BgzfSource()
+{
+    bgzf_close(bgzf_);
+}
+
+// Seek unless the file is already there (e.g. right after the preceding
+// record)
+void BgzfSource::seek(uint64_t pointer)
+{
+    if ((uint64_t)bgzf_tell(bgzf_) == pointer) return;
+    if (bgzf_seek(bgzf_, pointer, SEEK_SET) == -1)
+        throw std::runtime_error("Unreadable BGZF file " + fname_);
+}
+
+void BgzfSource::read(char* data, size_t size)
+{
+    if (bgzf_read(bgzf_, data, size) != (int)size)
+        throw std::runtime_error("Unreadable BGZF file " + fname_);
+}
+
+FileSource::FileSource(const string &fname)
+: fname_(fname), file_(fname.c_str(), std::ios::in | std::ios::binary)
+{
+    if (!file_.is_open())
+        throw std::runtime_error("Unreadable binary file " + fname);
+}
+
+// Seek unless the file is already there
+void FileSource::seek(uint64_t pointer)
+{
+    if ((uint64_t)file_.tellg() == pointer) return;
+    file_.seekg(pointer);
+    if (file_.fail())
+        throw std::runtime_error("Unreadable binary file " + fname_);
+}
+
+void FileSource::read(char* data, size_t size)
+{
+    file_.read(data, size);
+    if (file_.gcount() != (std::streamsize)size)
+        throw std::runtime_error("Unreadable binary file " + fname_);
+}
+
+MappedSource::MappedSource(const string &fname)
+: fname_(fname), data_(NULL), size_(0), pos_(0)
+{
+    int fd = open(fname.c_str(), O_RDONLY);
+    struct stat st;
+    if ((fd == -1) || (fstat(fd, &st) == -1))
+    {
+        if (fd != -1) close(fd);
+        throw std::runtime_error("Unreadable file " + fname);
+    }
+    void* data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        throw std::runtime_error("Unreadable file " + fname);
+    data_ = (const char*)data;
+    size_ = st.st_size;
+}
+
+MappedSource::~MappedSource()
+{
+    munmap((void*)data_, size_);
+}
+
+void MappedSource::seek(uint64_t pointer)
+{
+    if (pointer > size_) throw std::runtime_error("Unreadable file " + fname_);
+    pos_ = pointer;
+}
+
+void MappedSource::read(char* data, size_t size)
+{
+    if (pos_ + size > size_)
+        throw std::runtime_error("Unreadable file " + fname_);
+    memcpy(data, data_ + pos_, size);
+    pos_ += size;
+}
@@ -1,6 +1,9 @@
 #include <vector>
 #include <map>
+#include <algorithm>
 #include <cstdint>
+#include <mutex>
+#include <atomic>
 
 #include <iostream>
 #include <typeinfo>
@@ -10,25 +13,50 @@
 using std::vector;
 using std::map;
 
+namespace
+{
+    // Returned for informant genomes not aligned to a reference
+    vector<Informant*> no_informants;
+    vector<Segment> no_segments;
+}
+
 Sequence::~Sequence()
 {
     delete sequence_;
     if (has_rankselect_) delete rankselect_;
 }
 
-void Sequence::add_sequence(std::vector<bool>* sequence)
+void Sequence::add_sequence(BitVector* sequence)
+{
+    for (seqpos_t i = 0; i < sequence->size(); ++i)
+    {
+        sequence_->push_back((*sequence)[i]);
+    }
+}
+
+// Bytes taken by the sequence
+uint64_t Sequence::memory_usage()
 {
-    for (auto it = sequence->begin(); it != sequence->end(); ++it)
+    uint64_t bytes = sizeof(Sequence) + sequence_->memory_usage();
+    if (has_rankselect_)
     {
-        sequence_->push_back(*it);
+        bytes += sizeof(vector<seqpos_t>) +
+                 rankselect_->capacity() * sizeof(seqpos_t);
     }
+    return bytes;
 }
 
-std::vector<bool>* Sequence::get_sequence()
+BitVector* Sequence::get_sequence()
 {
     return sequence_;
 }
 
+std::vector<seqpos_t>* Sequence::get_rankselect()
+{
+    if (!has_rankselect_) return NULL;
+    return rankselect_;
+}
+
 seqpos_t Sequence::get_chr_pos()
 {
     return chr_pos_;
@@ -39,7 +67,7 @@ seqpos_t Sequence::get_bases_count()
     return bases_count_;
 }
 
-seqpos_t Sequence::get_chr_id()
+bioid_t Sequence::get_chr_id()
 {
     return chr_id_;
 }
@@ -62,25 +90,25 @@ void Sequence::print_info()
 
 void Sequence::print_seq()
 {
-    for (auto it = sequence_->begin(); it != sequence_->end(); ++it)
-        std::cout << *it;
+    for (seqpos_t i = 0; i < sequence_->size(); ++i)
+        std::cout << (*sequence_)[i];
     std::cout << std::endl;
 }
 
 // Find index of 'number'-th '1' in this sequence
-int Sequence::select(int number)
+seqpos_t Sequence::select(seqpos_t number)
 {
-    int rs = number/SELECT_BITS;
-    if (rs >= (int)rankselect_->size())
+    seqpos_t rs = number/SELECT_BITS;
+    if (rs >= (seqpos_t)rankselect_->size())
     {
-        rs = (int)rankselect_->size() - 1;
+        rs = (seqpos_t)rankselect_->size() - 1;
         number = SELECT_BITS;
     }
     else number = number % SELECT_BITS;
 //     rs = number/SELECT_BITS;
 //     number = number % SELECT_BITS;
-    int seq_pos = (*rankselect_)[rs];
-    while ((seq_pos+1 < (int)sequence_->size()) &&
+    seqpos_t seq_pos = (*rankselect_)[rs];
+    while ((seq_pos+1 < sequence_->size()) &&
            ((number > 0) || (!(*sequence_)[seq_pos+1])))
     {
         number -= (*sequence_)[++seq_pos];
@@ -90,7 +118,7 @@ int Sequence::select(int number)
 }
 
 
-int Sequence::rank(seqpos_t seq_pos)
+seqpos_t Sequence::rank(seqpos_t seq_pos)
 {
     if (seq_pos >= this->length()) seq_pos = this->length() - 1;
     // Uncomment the commented lines to put rank in use (do not forget about
@@ -102,12 +130,7 @@ int Sequence::rank(seqpos_t seq_pos)
 //         if ((*(this->get_sequence()))[from+i]) ++ret;
 //     }
 //     return ret;
-    seqpos_t ret = this->get_chr_pos();
-    for (int i = 0; i < seq_pos; ++i)
-    {
-        if ((*(this->get_sequence()))[i]) ++ret;
-    }
-    return ret;
+    return this->get_chr_pos() + sequence_->count(0, seq_pos);
 }
 
 seqpos_t Sequence::min(seqpos_t x, seqpos_t y)
@@ -127,6 +150,12 @@ void Informant::print_info()
     std::cout << this->get_bases_count() << " "  << seq_pos_ << std::endl;
 }
 
+// Bytes taken by the informant
+uint64_t Informant::memory_usage()
+{
+    return sizeof(Informant) - sizeof(Sequence) + Sequence::memory_usage();
+}
+
 seqpos_t Informant::get_seq_pos()
 {
     return seq_pos_;
@@ -137,18 +166,51 @@ Reference* Informant::get_ref()
     return aligned_to_;
 }
 
-// Find '1' in inf. sequence corresponding to given '1' in ref. if possible
-bool Informant::find_aligned_one(int way, int &jinf, int &jref)
+// Find '1' in inf. sequence corresponding to given '1' in ref. if possible,
+// comparing the sequences a word at a time
+template <int way>
+bool Informant::find_aligned_one(seqpos_t &jinf, seqpos_t &jref)
 {
-    while (!((*get_sequence())[jinf]) ||
-           !((*(aligned_to_->get_sequence()))[jref]))
+    seqpos_t count;
+    if (way == 1) count = min(length() - jinf, aligned_to_->length() - jref);
+    else count = min(jinf, jref) + 1;
+    if (count <= 0) return false;
+    seqpos_t k = BitVector::find_aligned<way>(*get_sequence(), jinf,
+                                              *(aligned_to_->get_sequence()),
+                                              jref, count);
+    jinf += way*k;
+    jref += way*k;
+    return k < count;
+}
+
+template bool Informant::find_aligned_one<1>(seqpos_t &jinf, seqpos_t &jref);
+template bool Informant::find_aligned_one<-1>(seqpos_t &jinf,
+                                              seqpos_t &jref);
+
+BlockSummary::BlockSummary(bioid_t inf_id, vector<Informant*>::iterator first,
+                           vector<Informant*>::iterator last)
+: inf_id(inf_id), chr_id((*first)->get_chr_id()),
+strand((*first)->get_strand()), ordered(true),
+first_chr_pos((*first)->get_chr_pos()), first_seq_pos((*first)->get_seq_pos()),
+max_inf_gap(0), max_ref_gap(0)
+{
+    last_inf_end = first_chr_pos + (*first)->get_bases_count();
+    last_ref_end = first_seq_pos + (*first)->get_bases_count();
+    for (auto it = first + 1; it <= last; ++it)
     {
-        jinf += way;
-        jref += way;
-        if (jinf >= length()) return false;
-        if (jinf < 0) return false;
+        if ((last_inf_end > (*it)->get_chr_pos()) ||
+            (strand != (*it)->get_strand()) ||
+            (chr_id != (*it)->get_chr_id()))
+        {
+            ordered = false;
+        }
+        max_inf_gap = std::max(max_inf_gap,
+                               (*it)->get_chr_pos() - last_inf_end);
+        max_ref_gap = std::max(max_ref_gap,
+                               (*it)->get_seq_pos() - last_ref_end);
+        last_inf_end = (*it)->get_chr_pos() + (*it)->get_bases_count();
+        last_ref_end = (*it)->get_seq_pos() + (*it)->get_bases_count();
     }
-    return true;
 }
 
 Reference::~Reference()
@@ -161,11 +223,54 @@ Reference::~Reference()
             delete (*it2);
         }
     }
+    for (auto it = segments_.begin(); it != segments_.end(); ++it)
+    {
+        delete it->second.segments.load();
+    }
 }
 
+// Bytes taken by the reference with its informants and segments
+uint64_t Reference::memory_usage()
+{
+    uint64_t bytes = sizeof(Reference) - sizeof(Sequence) +
+                     Sequence::memory_usage();
+    for (auto it = informants_.begin(); it != informants_.end(); ++it)
+    {
+        bytes += MAP_NODE_SIZE + sizeof(*it) +
+                 it->second.capacity() * sizeof(Informant*);
+        for (auto inf = it->second.begin(); inf != it->second.end(); ++inf)
+            bytes += (*inf)->memory_usage();
+    }
+    for (auto it = segments_.begin(); it != segments_.end(); ++it)
+    {
+        vector<Segment>* segments = it->second.segments.load();
+        bytes += MAP_NODE_SIZE + sizeof(*it);
+        if (segments != NULL)
+        {
+            bytes += sizeof(vector<Segment>) +
+                     segments->capacity() * sizeof(Segment);
+        }
+    }
+    return bytes;
+}
+
+// Informants of genome 'inf_id' aligned to this reference, empty if none
 std::vector<Informant*>* Reference::get_informant_vector(bioid_t inf_id)
 {
-    return &(informants_[inf_id]);
+    auto it = informants_.find(inf_id);
+    if (it == informants_.end()) return &no_informants;
+    return &(it->second);
+}
+
+// Get ids of informants aligned to this reference, in ascending order
+std::vector<bioid_t> Reference::get_informant_ids()
+{
+    vector<bioid_t> ids;
+    for (auto it = informants_.begin(); it != informants_.end(); ++it)
+    {
+        if (!it->second.empty()) ids.push_back(it->first);
+    }
+    return ids;
 }
 
 void Reference::add_informant(bioid_t inf_id, Informant* informant)
@@ -173,32 +278,36 @@ void Reference::add_informant(bioid_t inf_id, Informant* informant)
     if (informants_.count(inf_id) == 0)
     {
         informants_[inf_id] = vector<Informant*>();
+        segments_[inf_id];
     }
     informants_[inf_id].push_back(informant);
 }
 
-// Finds the informant which is aligned to 'seq_pos'
+// Finds the informant which is aligned to 'seq_pos' or, if there is none,
+// the nearest one in direction 'way'
+template <int way>
 bool Reference::find_informant(seqpos_t &inf_index,
-                               bioid_t inf_id, seqpos_t seq_pos, int way)
+                               bioid_t inf_id, seqpos_t seq_pos)
 {
-    unsigned lo = 0, hi = informants_[inf_id].size(), mid;
+    vector<Informant*> &informants = *get_informant_vector(inf_id);
+    unsigned lo = 0, hi = informants.size(), mid;
     if ((hi == 0) ||
-        ((seq_pos < informants_[inf_id][0]->get_seq_pos()) && (way == -1)) ||
-        ((seq_pos >= informants_[inf_id][hi-1]->get_seq_pos() +
-         informants_[inf_id][hi-1]->length()) && (way == 1)))
+        ((seq_pos < informants[0]->get_seq_pos()) && (way == -1)) ||
+        ((seq_pos >= informants[hi-1]->get_seq_pos() +
+         informants[hi-1]->length()) && (way == 1)))
     {
         return false;
     }
-    else if ((seq_pos < informants_[inf_id][0]->get_seq_pos() +
-              informants_[inf_id][0]->length()) && (way == 1))
+    else if ((seq_pos < informants[0]->get_seq_pos() +
+              informants[0]->length()) && (way == 1))
     {
         inf_index = 0;
         return true;
     }
-    else if ((seq_pos >= informants_[inf_id][hi-1]->get_seq_pos()) &&
+    else if ((seq_pos >= informants[hi-1]->get_seq_pos()) &&
              (way == -1))
     {
-        inf_index = informants_[inf_id].size() - 1;
+        inf_index = informants.size() - 1;
         return true;
     }
     // Now is guaranteed that seq_pos is contained in this interval:
@@ -207,16 +316,16 @@ bool Reference::find_informant(seqpos_t &inf_index,
     while (lo < hi)
     {
         mid = (lo+hi)/2;
-        if ((seq_pos - informants_[inf_id][mid]->get_seq_pos() <
-             informants_[inf_id][mid]->length()) &&
-            (seq_pos - informants_[inf_id][mid]->get_seq_pos() >= 0))
+        if ((seq_pos - informants[mid]->get_seq_pos() <
+             informants[mid]->length()) &&
+            (seq_pos - informants[mid]->get_seq_pos() >= 0))
         {
             hi = lo;
         }
-        if ((mid + 1 < informants_[inf_id].size()) &&
-            (seq_pos >= informants_[inf_id][mid]->get_seq_pos() +
-             informants_[inf_id][mid]->length()) &&
-            (seq_pos < informants_[inf_id][mid+1]->get_seq_pos()))
+        if ((mid + 1 < informants.size()) &&
+            (seq_pos >= informants[mid]->get_seq_pos() +
+             informants[mid]->length()) &&
+            (seq_pos < informants[mid+1]->get_seq_pos()))
         {
             if (way == 1)
             {
@@ -225,15 +334,15 @@ bool Reference::find_informant(seqpos_t &inf_index,
             }
             else hi = lo;
         }
-        else if ((seq_pos >= informants_[inf_id][mid]->get_seq_pos() +
-                  informants_[inf_id][mid]->length()) &&
-                 (seq_pos - informants_[inf_id][mid]->get_seq_pos() >= 0))
+        else if ((seq_pos >= informants[mid]->get_seq_pos() +
+                  informants[mid]->length()) &&
+                 (seq_pos - informants[mid]->get_seq_pos() >= 0))
         {
             lo = mid;
         }
-        else if ((seq_pos - informants_[inf_id][mid]->get_seq_pos() <
-                 informants_[inf_id][mid]->length()) &&
-                 (seq_pos - informants_[inf_id][mid]->get_seq_pos() < 0))
+        else if ((seq_pos - informants[mid]->get_seq_pos() <
+                 informants[mid]->length()) &&
+                 (seq_pos - informants[mid]->get_seq_pos() < 0))
         {
             hi = mid;
         }
@@ -243,6 +352,139 @@ bool Reference::find_informant(seqpos_t &inf_index,
     return true;
 }
 
+template bool Reference::find_informant<1>(seqpos_t &inf_index,
+                                           bioid_t inf_id, seqpos_t seq_pos);
+template bool Reference::find_informant<-1>(seqpos_t &inf_index,
+                                            bioid_t inf_id, seqpos_t seq_pos);
+
+// Compile the alignment to informant 'inf_id' into ungapped segments
+std::vector<Segment>* Reference::build_segments(bioid_t inf_id)
+{
+    vector<Segment>* segments = new vector<Segment>;
+    vector<Informant*> &informants = *get_informant_vector(inf_id);
+    BitVector &ref_seq = *get_sequence();
+    seqpos_t jref = 0, ref_pos = get_chr_pos();
+    for (unsigned k = 0; k < informants.size(); ++k)
+    {
+        BitVector &inf_seq = *(informants[k]->get_sequence());
+        // Count reference bases preceding this informant
+        if (informants[k]->get_seq_pos() < jref)
+        {
+            jref = 0;
+            ref_pos = get_chr_pos();
+        }
+        ref_pos += ref_seq.count(jref, informants[k]->get_seq_pos());
+        jref = informants[k]->get_seq_pos();
+        seqpos_t inf_pos = informants[k]->get_chr_pos();
+        seqpos_t jinf = 0, jref_aligned = jref;
+        // Jump between runs of columns aligning bases of both sequences
+        while (informants[k]->find_aligned_one<1>(jinf, jref_aligned))
+        {
+            ref_pos += ref_seq.count(jref, jref_aligned);
+            inf_pos += inf_seq.count(jref - informants[k]->get_seq_pos(),
+                                     jinf);
+            seqpos_t run = BitVector::aligned_run(inf_seq, jinf, ref_seq,
+                                                  jref_aligned,
+                                                  informants[k]->length() -
+                                                  jinf);
+            // Extend the last segment if no base of either sequence
+            // was skipped since its end, start a new one otherwise
+            if (!segments->empty() && (segments->back().inf_index == k) &&
+                (segments->back().ref_pos + segments->back().length ==
+                 ref_pos) &&
+                (segments->back().inf_pos + segments->back().length ==
+                 inf_pos))
+            {
+                segments->back().length += run;
+            }
+            else
+            {
+                segments->push_back(Segment(ref_pos, inf_pos, run,
+                    informants[k]->get_strand(), k));
+            }
+            ref_pos += run;
+            inf_pos += run;
+            jinf += run;
+            jref_aligned += run;
+            jref = jref_aligned;
+        }
+        // Columns after the last aligned one
+        seqpos_t inf_end = informants[k]->get_seq_pos() +
+                           informants[k]->length();
+        ref_pos += ref_seq.count(jref, inf_end);
+        jref = inf_end;
+    }
+    return segments;
+}
+
+// Get ungapped segments of the alignment to informant 'inf_id', sorted by
+// reference position; they are built on first use and kept with this block
+std::vector<Segment>* Reference::get_segments(bioid_t inf_id)
+{
+    auto it = segments_.find(inf_id);
+    if (it == segments_.end()) return &no_segments;
+    SegmentIndex &index = it->second;
+    std::call_once(index.built, [this, inf_id, &index]()
+                   { index.segments = build_segments(inf_id); });
+    return index.segments.load();
+}
+
+// Find the segment containing 'position' or, if it falls into a gap,
+// the nearest segment in direction 'way'. The search starts at segment
+// 'cursor' (positions queried in ascending order may keep passing it) and
+// leaves it at the first segment ending after 'position'.
+template <int way>
+bool Reference::find_segment(unsigned &seg_index, bioid_t inf_id,
+                             seqpos_t position, unsigned &cursor)
+{
+    vector<Segment> &segments = *get_segments(inf_id);
+    // Gallop from the cursor, then binary search for the first segment
+    // ending after 'position'
+    unsigned lo = cursor, hi = segments.size(), mid, step = 1;
+    if ((lo > hi) ||
+        ((lo > 0) && (segments[lo-1].ref_pos + segments[lo-1].length >
+                      position)))
+    {
+        lo = 0;
+    }
+    while ((lo + step < hi) &&
+           (segments[lo+step].ref_pos + segments[lo+step].length <= position))
+    {
+        lo += step;
+        step *= 2;
+    }
+    if (lo + step < hi) hi = lo + step + 1;
+    while (lo < hi)
+    {
+        mid = (lo+hi)/2;
+        if (segments[mid].ref_pos + segments[mid].length <= position)
+            lo = mid + 1;
+        else hi = mid;
+    }
+    cursor = lo;
+    if (way == 1)
+    {
+        if (lo == segments.size()) return false;
+        seg_index = lo;
+        return true;
+    }
+    if ((lo < segments.size()) && (segments[lo].ref_pos <= position))
+    {
+        seg_index = lo;
+        return true;
+    }
+    if (lo == 0) return false;
+    seg_index = lo - 1;
+    return true;
+}
+
+template bool Reference::find_segment<1>(unsigned &seg_index,
+                                         bioid_t inf_id, seqpos_t position,
+                                         unsigned &cursor);
+template bool Reference::find_segment<-1>(unsigned &seg_index,
+                                          bioid_t inf_id, seqpos_t position,
+                                          unsigned &cursor);
+
 void Reference::print_info()
 {
     Sequence::print_info();
@@ -255,4 +497,104 @@ void Reference::print_info()
             (*it2)->Informant::print_info();
         }
     }
-}
\ No newline at end of file
+}
+// Bytes taken by the array, not counting the informants it points to
+uint64_t InformantArray::memory_usage()
+{
+    return sizeof(InformantArray) +
+           references_.capacity() * sizeof(Reference*) +
+           informants_.capacity() * sizeof(Informant*) +
+           offsets_.capacity() * sizeof(seqpos_t);
+}
+
+int InformantArray::first_block()
+{
+    return first_block_;
+}
+
+// Return index of the block following the window
+int InformantArray::end_block()
+{
+    return first_block_ + references_.size();
+}
+
+vector<Informant*>::iterator InformantArray::get_block(int block)
+{
+    return informants_.begin() + offsets_[block - first_block_];
+}
+
+// Make the window contain blocks first_block .. first_block+size-1, which
+// are given in 'references'; the window is only extended if it overlaps or
+// touches these blocks
+void InformantArray::extend(int first_block, vector<Reference*> &references,
+                            bioid_t inf_id)
+{
+    int last_block = first_block + references.size();
+    if (references_.empty() || (first_block > end_block()) ||
+        (last_block < first_block_))
+    {
+        clear();
+        first_block_ = first_block;
+    }
+    // Blocks preceding the window
+    if (first_block < first_block_)
+    {
+        vector<Informant*> added;
+        vector<seqpos_t> added_offsets;
+        for (int i = first_block; i < first_block_; ++i)
+        {
+            vector<Informant*>* infs =
+                references[i - first_block]->get_informant_vector(inf_id);
+            added_offsets.push_back(added.size());
+            added.insert(added.end(), infs->begin(), infs->end());
+        }
+        for (auto it = offsets_.begin(); it != offsets_.end(); ++it)
+            *it += added.size();
+        informants_.insert(informants_.begin(), added.begin(), added.end());
+        offsets_.insert(offsets_.begin(), added_offsets.begin(),
+                        added_offsets.end());
+        references_.insert(references_.begin(), references.begin(),
+                           references.begin() + (first_block_ - first_block));
+        first_block_ = first_block;
+    }
+    // Blocks following the window
+    for (int i = end_block(); i < last_block; ++i)
+    {
+        Reference* reference = references[i - first_block];
+        vector<Informant*>* infs = reference->get_informant_vector(inf_id);
+        informants_.insert(informants_.end(), infs->begin(), infs->end());
+        offsets_.push_back(informants_.size());
+        references_.push_back(reference);
+    }
+}
+
+// Shrink the window so that it does not contain the given reference
+// (cutting off the shorter side)
+void InformantArray::remove(Reference* reference)
+{
+    unsigned i = 0;
+    while ((i < references_.size()) && (references_[i] != reference)) ++i;
+    if (i == references_.size()) return;
+    if (i < references_.size()/2)
+    {
+        seqpos_t cut = offsets_[i+1];
+        informants_.erase(informants_.begin(), informants_.begin() + cut);
+        offsets_.erase(offsets_.begin(), offsets_.begin() + i + 1);
+        for (auto it = offsets_.begin(); it != offsets_.end(); ++it) *it -= cut;
+        references_.erase(references_.begin(), references_.begin() + i + 1);
+        first_block_ += i + 1;
+    }
+    else
+    {
+        informants_.resize(offsets_[i]);
+        offsets_.resize(i + 1);
+        references_.resize(i);
+    }
+}
+
+void InformantArray::clear()
+{
+    references_.clear();
+    informants_.clear();
+    offsets_.assign(1, 0);
+}
@@ -0,0 +1,279 @@
+#include <string>
+#include <vector>
+#include <stdexcept>
+#include <functional>
+#include <cstring>
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <iostream>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "include/SharedPool.h"
+
+using std::string;
+using std::vector;
+
+
+// Attach to the pool of the given name, creating it with 'size' bytes if
+// there is none yet
+SharedPool::SharedPool(const string &name, uint64_t size)
+: name_("/" + name), size_(size), header_(NULL), slots_(NULL), arena_(NULL),
+hits_(0), misses_(0), failed_(false)
+{
+    bool created = true;
+    int fd = shm_open(name_.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    if ((fd == -1) && (errno == EEXIST))
+    {
+        created = false;
+        fd = shm_open(name_.c_str(), O_RDWR, 0600);
+    }
+    if (fd == -1)
+        throw std::runtime_error("Can not open shared pool " + name);
+    struct stat st;
+    if (created)
+    {
+        if (ftruncate(fd, size_) == -1)
+        {
+            close(fd);
+            shm_unlink(name_.c_str());
+            throw std::runtime_error("Can not allocate shared pool " + name);
+        }
+    }
+    else
+    {
+        // Wait until the creator sets the size
+        for (int i = 0; ; ++i)
+        {
+            if ((fstat(fd, &st) == -1) || (i == 1000))
+            {
+                close(fd);
+                throw std::runtime_error("Can not open shared pool " + name);
+            }
+            if (st.st_size > 0) break;
+            usleep(1000);
+        }
+        size_ = st.st_size;
+    }
+    void* memory = mmap(NULL, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+                        0);
+    close(fd);
+    if (memory == MAP_FAILED)
+        throw std::runtime_error("Can not map shared pool " + name);
+    header_ = (Header*)memory;
+    if (created)
+    {
+        try
+        {
+            initialize();
+        }
+        catch (std::runtime_error &e)
+        {
+            munmap(header_, size_);
+            shm_unlink(name_.c_str());
+            throw;
+        }
+    }
+    // Wait until the creator initializes the pool
+    for (int i = 0; __atomic_load_n(&header_->magic, __ATOMIC_ACQUIRE) != MAGIC;
+         ++i)
+    {
+        if (i == 1000)
+        {
+            munmap(header_, size_);
+            throw std::runtime_error("Shared pool " + name + " is not valid");
+        }
+        usleep(1000);
+    }
+    slots_ = (Slot*)(header_ + 1);
+    arena_ = (char*)(slots_ + header_->slot_count);
+}
+
+SharedPool::~SharedPool()
+{
+    if (header_ != NULL) munmap(header_, size_);
+}
+
+// Set up an empty pool, one slot per 16 KiB of its size
+void SharedPool::initialize()
+{
+    header_->size = size_;
+    header_->slot_count = size_ / (16 << 10) + 1;
+    uint64_t arena_offset = sizeof(Header) + header_->slot_count * sizeof(Slot);
+    if (arena_offset + 16 * ENTRY_ALIGN > size_)
+        throw std::runtime_error("Shared pool " + name_ + " is too small");
+    header_->arena_size = (size_ - arena_offset) / ENTRY_ALIGN * ENTRY_ALIGN;
+    header_->head = header_->tail = header_->used = 0;
+    memset((void*)(header_ + 1), 0, header_->slot_count * sizeof(Slot));
+    pthread_mutexattr_t attr;
+    if (pthread_mutexattr_init(&attr) != 0)
+        throw std::runtime_error("Can not lock shared pool " + name_);
+    int status = pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    if (status == 0)
+        status = pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    if (status == 0) status = pthread_mutex_init(&header_->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    if (status != 0)
+        throw std::runtime_error("Can not lock shared pool " + name_);
+    __atomic_store_n(&header_->magic, MAGIC, __ATOMIC_RELEASE);
+}
+
+// Lock the pool; if its last owner died while holding it, the records can
+// be half written, so they are all dropped. Return false if the pool can
+// not be locked (e.g. its lock was left unrecoverable); it is not used
+// from then on and records are read from their files.
+bool SharedPool::lock()
+{
+    if (failed_) return false;
+    int status = pthread_mutex_lock(&header_->lock);
+    if (status == EOWNERDEAD)
+    {
+        memset((void*)slots_, 0, header_->slot_count * sizeof(Slot));
+        header_->head = header_->tail = header_->used = 0;
+        status = pthread_mutex_consistent(&header_->lock);
+        if (status != 0) pthread_mutex_unlock(&header_->lock);
+    }
+    if (status == 0) return true;
+    if (!failed_.exchange(true))
+    {
+        std::cerr << "Can not lock shared pool " << name_.substr(1) << " ("
+                  << strerror(status) << "), it will not be used; remove "
+                  << "/dev/shm" << name_ << " to create it anew" << std::endl;
+    }
+    return false;
+}
+
+void SharedPool::unlock()
+{
+    pthread_mutex_unlock(&header_->lock);
+}
+
+uint64_t SharedPool::slot_of(uint64_t file_id, uint64_t pointer)
+{
+    uint64_t h = (file_id ^ (pointer * 0x9e3779b97f4a7c15ULL));
+    h ^= h >> 31;
+    return h % header_->slot_count;
+}
+
+// Return offset of 'need' free bytes in the arena, evicting the oldest
+// entries to make room
+uint64_t SharedPool::allocate(uint64_t need)
+{
+    while (true)
+    {
+        if (header_->used == 0) header_->head = header_->tail = 0;
+        uint64_t head = header_->head, tail = header_->tail;
+        if ((head > tail) || (header_->used == 0))
+        {
+            if (header_->arena_size - head >= need) return head;
+            // Skip the rest of the arena, entries do not wrap around
+            Entry* pad = (Entry*)(arena_ + head);
+            pad->slot = PAD_SLOT;
+            pad->length = header_->arena_size - head - sizeof(Entry);
+            header_->used += header_->arena_size - head;
+            header_->head = 0;
+        }
+        else if (tail - head >= need) return head;
+        else evict();
+    }
+}
+
+// Drop the oldest entry of the arena
+void SharedPool::evict()
+{
+    Entry* entry = (Entry*)(arena_ + header_->tail);
+    if ((entry->slot != PAD_SLOT) &&
+        (slots_[entry->slot].offset == header_->tail))
+    {
+        slots_[entry->slot].length = 0;
+    }
+    uint64_t size = sizeof(Entry) +
+        (entry->length + ENTRY_ALIGN - 1) / ENTRY_ALIGN * ENTRY_ALIGN;
+    header_->tail += size;
+    if (header_->tail == header_->arena_size) header_->tail = 0;
+    header_->used -= size;
+}
+
+// Copy the record at 'pointer' of the given file into 'data' if the pool
+// has it
+bool SharedPool::get(uint64_t file_id, uint64_t pointer, vector<char> &data)
+{
+    if (!lock())
+    {
+        ++misses_;
+        return false;
+    }
+    Slot &slot = slots_[slot_of(file_id, pointer)];
+    bool found = (slot.length > 0) && (slot.file_id == file_id) &&
+                 (slot.pointer == pointer);
+    if (found)
+    {
+        data.resize(slot.length);
+        memcpy(&data[0], arena_ + slot.offset + sizeof(Entry), slot.length);
+    }
+    unlock();
+    if (found) ++hits_;
+    else ++misses_;
+    return found;
+}
+
+// Add the record at 'pointer' of the given file, replacing the one with the
+// same slot; records larger than half of the arena are not kept
+void SharedPool::put(uint64_t file_id, uint64_t pointer, const char* data,
+                     uint64_t length)
+{
+    uint64_t need = sizeof(Entry) +
+        (length + ENTRY_ALIGN - 1) / ENTRY_ALIGN * ENTRY_ALIGN;
+    if ((length == 0) || (need > header_->arena_size / 2) || !lock()) return;
+    uint64_t index = slot_of(file_id, pointer);
+    Slot &slot = slots_[index];
+    if ((slot.length > 0) && (slot.file_id == file_id) &&
+        (slot.pointer == pointer))
+    {
+        unlock();
+        return;
+    }
+    uint64_t offset = allocate(need);
+    Entry* entry = (Entry*)(arena_ + offset);
+    entry->slot = index;
+    entry->length = length;
+    memcpy(arena_ + offset + sizeof(Entry), data, length);
+    slot.file_id = file_id;
+    slot.pointer = pointer;
+    slot.offset = offset;
+    slot.length = length;
+    header_->head = offset + need;
+    if (header_->head == header_->arena_size) header_->head = 0;
+    header_->used += need;
+    unlock();
+}
+
+uint64_t SharedPool::get_hits()
+{
+    return hits_;
+}
+
+uint64_t SharedPool::get_misses()
+{
+    return misses_;
+}
+
+// Identify a file by its absolute path, size and modification time, so that
+// a rewritten file does not match records of its older version
+uint64_t SharedPool::file_id(const string &fname)
+{
+    char path[PATH_MAX];
+    struct stat st;
+    if ((realpath(fname.c_str(), path) == NULL) ||
+        (stat(fname.c_str(), &st) == -1))
+    {
+        throw std::runtime_error("Unreadable file " + fname);
+    }
+    string identity = string(path) + "\t" + std::to_string(st.st_size) +
+                      "\t" + std::to_string(st.st_mtime);
+    return std::hash<string>()(identity);
+}
@@ -0,0 +1,150 @@
+#!/bin/bash
+# Check that regions map the same way from every kind of store and with
+# every reading option. Usage (after "make"):
+#   ./check.sh <header.bin> <compressed.bgzf> <informant> <regions.bed>
+# <header.bin> and <compressed.bgzf> are files written by preprocessing
+# (the original format). Their output for <regions.bed> is the one all
+# others are compared with, so the regions should be ones which map.
+# MAPTOOL may name another maptool binary than the one next to this script.
+
+if [ $# -ne 4 ]; then
+    echo "Usage: $0 <header.bin> <compressed.bgzf> <informant> <regions.bed>"
+    exit 2
+fi
+maptool=${MAPTOOL:-$(dirname "$0")/maptool}
+header=$1
+store=$2
+informant=$3
+regions=$4
+work=$(mktemp -d)
+pool=maptool-check-$$
+trap 'rm -rf "$work" "/dev/shm/$pool"' EXIT
+failed=0
+
+# Report a failed check
+fail()
+{
+    echo "FAIL $1"
+    failed=1
+}
+
+# Run a maptool command which writes files, stop checking if it fails
+run()
+{
+    if ! "$maptool" "$@" > "$work/log" 2>&1; then
+        fail "maptool $*"
+        cat "$work/log"
+        exit 1
+    fi
+}
+
+# Map the regions into $work/<name>.bed and $work/<name>.err
+map()
+{
+    local name=$1
+    shift
+    "$maptool" bed "$@" < "$regions" > "$work/$name.bed" \
+        2> "$work/$name.err" || fail "maptool bed $* exited with an error"
+}
+
+# Compare output <name> with output <reference> of the original store
+same()
+{
+    if cmp -s "$work/$2.bed" "$work/$1.bed" &&
+       cmp -s "$work/$2.err" "$work/$1.err"; then
+        echo "ok   $3"
+    else
+        fail "$3"
+        diff "$work/$2.bed" "$work/$1.bed" | head -5
+        diff "$work/$2.err" "$work/$1.err" | head -5
+    fi
+}
+
+# Stores written from the original one
+run convert "$header" "$store" "$work/v2.bin" "$work/v2.bgzf"
+run repack "$work/v2.bin" "$work/v2.bgzf" "$work/rp.bin" "$work/rp.bgzf"
+run convert "$header" "$store" "$work/sh.bin" "$work/sh.bgzf" --sharded
+run repack "$work/v2.bin" "$work/v2.bgzf" "$work/rs.bin" "$work/rs.bgzf" \
+    --sharded
+run extract "$header" "$store" "$informant" "$work/p.pmap"
+
+# Each configuration is checked separately
+for config in "inner:10" "outer:50"; do
+    options="--maxgap ${config#*:}"
+    [ "${config%%:*}" = outer ] && options="$options --outer"
+    v1=v1-$config
+    map $v1 "$header" "$store" "$informant" $options
+    [ -s "$work/$v1.bed" ] || echo "warning: no region maps in $config"
+
+    map v2 "$work/v2.bin" "$work/v2.bgzf" "$informant" $options
+    same v2 $v1 "$config convert"
+    map rp "$work/rp.bin" "$work/rp.bgzf" "$informant" $options
+    same rp $v1 "$config convert, repack"
+    map sh "$work/sh.bin" "$work/sh.bgzf" "$informant" $options
+    same sh $v1 "$config convert --sharded"
+    map rs "$work/rs.bin" "$work/rs.bgzf" "$informant" $options
+    same rs $v1 "$config repack --sharded"
+    map p "$work/p.pmap" "$informant" $options
+    same p $v1 "$config extract"
+
+    map sparse "$work/rp.bin" "$work/rp.bgzf" "$informant" $options --sparse
+    same sparse $v1 "$config --sparse"
+    map threads "$header" "$store" "$informant" $options --threads 4
+    same threads $v1 "$config --threads 4"
+    map rp-threads "$work/rp.bin" "$work/rp.bgzf" "$informant" $options \
+        --threads 4 --sparse
+    same rp-threads $v1 "$config repack --threads 4 --sparse"
+
+    # The first process fills the pool, the second one reads from it
+    map pool "$header" "$store" "$informant" $options --shared-pool $pool
+    same pool $v1 "$config --shared-pool (new)"
+    map pool "$header" "$store" "$informant" $options --shared-pool $pool
+    same pool $v1 "$config --shared-pool (filled)"
+    rm -f "/dev/shm/$pool"
+
+    # Binary output holds the same records whatever the store
+    map binary "$header" "$store" "$informant" $options --binary
+    map rp-binary "$work/rp.bin" "$work/rp.bgzf" "$informant" $options \
+        --binary --threads 4
+    if cmp -s "$work/binary.bed" "$work/rp-binary.bed"; then
+        echo "ok   $config --binary"
+    else
+        fail "$config --binary"
+    fi
+done
+
+# Several configurations at once, split by their prefix
+map configs "$header" "$store" "$informant" --configs inner:10,outer:50
+for config in "inner:10" "outer:50"; do
+    grep "^$config	" "$work/configs.bed" | cut -f 2- > "$work/c.bed"
+    grep "^$config	" "$work/configs.err" | cut -f 2- > "$work/c.err"
+    same c v1-$config "--configs $config"
+done
+
+# A store sliced to the chromosome of the first region maps the regions
+# on it as the whole store does and rejects all the other ones
+chr=$(awk '!/^(#|track|browser)/ { print $1; exit }' "$regions")
+awk -v chr="$chr" '$1 == chr' "$regions" > "$work/in.bed"
+awk -v chr="$chr" '$1 != chr && !/^(#|track|browser)/' "$regions" \
+    > "$work/out.bed"
+run slice "$header" "$store" "$work/sl.bin" "$work/sl.bgzf" \
+    --chromosomes "$chr" --informants "$informant"
+regions=$work/in.bed
+map v1-in "$header" "$store" "$informant"
+map sl-in "$work/sl.bin" "$work/sl.bgzf" "$informant"
+same sl-in v1-in "slice, regions on $chr"
+regions=$work/out.bed
+map sl-out "$work/sl.bin" "$work/sl.bgzf" "$informant"
+if [ ! -s "$work/sl-out.bed" ] &&
+   [ "$(grep -vc unknown_chr "$work/sl-out.err")" = 0 ]; then
+    echo "ok   slice, regions on other chromosomes"
+else
+    fail "slice, regions on other chromosomes"
+    head -5 "$work/sl-out.bed"
+fi
+
+if [ $failed -ne 0 ]; then
+    echo "Some checks failed"
+    exit 1
+fi
+echo "All checks passed"
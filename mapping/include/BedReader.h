@@ -0,0 +1,42 @@
+#ifndef BEDREADER_H
+#define BEDREADER_H
+
+#include <string>
+#include <vector>
+#include <cstdio>
+
+#include <zlib.h>
+
+// Number of BGZF blocks inflated by each thread at once
+const unsigned BED_BLOCKS_PER_THREAD = 16;
+// Bytes inflated at once from other files
+const unsigned BED_CHUNK_SIZE = 1 << 20;
+
+// Lines of a BED file which is plain, gzipped or BGZF-compressed. Blocks of
+// a BGZF file are independent, so they are inflated by several threads at
+// once; other files are read by zlib as a stream.
+class BedReader
+{
+    public:
+        BedReader(const std::string &fname, unsigned threads = 0);
+        ~BedReader();
+        
+        bool get_line(std::string &line);
+        
+    private:
+        std::string fname_;
+        unsigned threads_;
+        // BGZF file read by blocks, or other file read by zlib
+        FILE* bgzf_;
+        gzFile gz_;
+        // Inflated bytes and position of the first unread one
+        std::vector<char> data_;
+        size_t data_pos_;
+        bool eof_;
+        
+        bool fill();
+        bool read_block(std::string &block);
+        void inflate_block(const std::string &block, std::string &out);
+};
+
+#endif /* BEDREADER_H */
@@ -0,0 +1,32 @@
+#ifndef BINARYWRITER_H
+#define BINARYWRITER_H
+
+#include <map>
+#include <string>
+#include <vector>
+#include <ostream>
+
+#include "Sequence.h"
+#include "Query.h"
+#include "MappedRecord.h"
+
+// Writer of the binary output described in MappedRecord.h
+class BinaryWriter
+{
+    public:
+        BinaryWriter(std::ostream &out,
+                     std::map<std::string, std::pair <bioid_t, seqpos_t> >
+                     &chr_map, const std::vector<std::string> &error_names);
+        
+        void write_answer(uint64_t line, unsigned config, BedQuery* answer);
+        void write_error(uint64_t line, unsigned config, uint8_t error);
+        
+    private:
+        std::ostream &out_;
+        std::map<std::string, std::pair <bioid_t, seqpos_t> > &chr_map_;
+        
+        void write_number(uint32_t number);
+        void write_string(const std::string &s);
+};
+
+#endif /* BINARYWRITER_H */
@@ -0,0 +1,59 @@
+#ifndef BITVECTOR_H
+#define BITVECTOR_H
+
+#include <vector>
+#include <cstdint>
+
+
+// Sequence of bits packed into 64-bit words, bit i is bit (i % 64) of word
+// i / 64; words past the end are kept zero so that whole words can be read
+// at any position
+class BitVector
+{
+    public:
+        BitVector(): size_(0), words_(PADDING_WORDS + 1, 0) {};
+        BitVector(int64_t size)
+        : size_(size), words_(size/64 + PADDING_WORDS + 1, 0) {};
+        
+        bool operator[](int64_t i) const
+        {
+            return (words_[i >> 6] >> (i & 63)) & 1;
+        }
+        void set(int64_t i)
+        {
+            words_[i >> 6] |= (uint64_t)1 << (i & 63);
+        }
+        // OR 'bits' into positions from i on, they must not cross a word
+        void set_bits(int64_t i, uint64_t bits)
+        {
+            words_[i >> 6] |= bits << (i & 63);
+        }
+        void set_range(int64_t from, int64_t to);
+        void push_back(bool bit);
+        int64_t size() const;
+        // Words holding the bits, word_count() of them are in use
+        uint64_t* words();
+        int64_t word_count() const;
+        int64_t count(int64_t from, int64_t to) const;
+        uint64_t memory_usage() const;
+        
+        template <int way>
+        static int64_t find_aligned(const BitVector &a, int64_t ja,
+                                    const BitVector &b, int64_t jb,
+                                    int64_t count);
+        static int64_t aligned_run(const BitVector &a, int64_t ja,
+                                   const BitVector &b, int64_t jb,
+                                   int64_t count);
+        
+    private:
+        // Widest block read at once by the vectorized search
+        static const int PADDING_WORDS = 8;
+        
+        int64_t size_;
+        std::vector<uint64_t> words_;
+        
+        uint64_t get_word(int64_t i) const;
+        uint64_t get_word_ending(int64_t i) const;
+};
+
+#endif /* BITVECTOR_H */
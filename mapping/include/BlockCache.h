@@ -0,0 +1,73 @@
+#ifndef BLOCKCACHE_H
+#define BLOCKCACHE_H
+
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <future>
+#include <atomic>
+#include <functional>
+#include <utility>
+#include <cstdint>
+
+#include "Sequence.h"
+
+// Decoded block shared by the cache and everyone using it; a block is freed
+// when the last handle to it is dropped
+typedef std::shared_ptr<Reference> ReferenceHandle;
+// Block by reference chromosome and pointer of its record
+typedef std::pair<bioid_t, uint64_t> BlockKey;
+
+// Most independently locked parts of a cache and fewest blocks in each, so
+// that a small cache is a single LRU list
+const unsigned BLOCK_CACHE_SHARDS = 8, BLOCK_CACHE_SHARD_BLOCKS = 64;
+
+// Decoded blocks shared by threads. Blocks of a large cache are spread over
+// shards by their keys, each locked by its own mutex and keeping its least
+// recently used blocks. A block with a handle outside the cache is pinned
+// and never evicted, so a shard may hold more blocks than its share while
+// they are in use. A block missing in the cache is decoded once: threads
+// asking for it meanwhile wait for the first one to finish.
+class BlockCache
+{
+    public:
+        BlockCache(unsigned capacity,
+                   unsigned max_shards = BLOCK_CACHE_SHARDS);
+        
+        ReferenceHandle find(const BlockKey &key);
+        ReferenceHandle get(const BlockKey &key,
+                            const std::function<Reference*()> &load,
+                            std::vector<ReferenceHandle> &evicted);
+        uint64_t size();
+        uint64_t memory_usage();
+        uint64_t get_peak_bytes();
+        
+    private:
+        struct Entry
+        {
+            ReferenceHandle reference;
+            uint64_t last_use;
+            // Bytes taken by the block when it was added
+            uint64_t bytes;
+        };
+        struct Shard
+        {
+            std::mutex lock;
+            std::map<BlockKey, Entry> entries;
+            // Blocks being decoded by some thread
+            std::map<BlockKey, std::shared_future<ReferenceHandle> > loading;
+        };
+        
+        unsigned shard_capacity_;
+        std::vector<Shard> shards_;
+        std::atomic<uint64_t> clock_, bytes_, peak_bytes_;
+        
+        static unsigned count_shards(unsigned capacity, unsigned max_shards);
+        Shard &shard_of(const BlockKey &key);
+        void insert(Shard &shard, const BlockKey &key,
+                    const ReferenceHandle &reference,
+                    std::vector<ReferenceHandle> &evicted);
+};
+
+#endif /* BLOCKCACHE_H */
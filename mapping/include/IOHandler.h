@@ -9,11 +9,43 @@
 #include <fstream>
 #include <ostream>
 #include <queue>
+#include <set>
 
 #include "../../../ocaml-bgzf/bgzf.h"
 
 #include "Sequence.h"
 #include "Query.h"
+#include "SharedPool.h"
+#include "BlockCache.h"
+#include "RecordSource.h"
+
+// Headers of newer formats start with FORMAT_MAGIC and a version byte
+const int FORMAT_MAGIC_SIZE = 4;
+const char FORMAT_MAGIC[FORMAT_MAGIC_SIZE] = {0, 'M', 'T', 'F'};
+const int FORMAT_V1 = 1, FORMAT_V2 = 2, FORMAT_V3 = 3, FORMAT_V4 = 4,
+    FORMAT_V5 = 5;
+// Encodings of bit vectors in records of the v2 format
+const int BITS_RAW = 0, BITS_RUNS = 1;
+// First line of a manifest of a sharded store, the following lines are
+// tab-separated reference chromosome names and files with their records
+const char SHARD_MANIFEST_MAGIC[] = "#maptool-shards";
+// Pairwise projections written by "extract" start with PROJECTION_MAGIC and
+// the offset of their header, which follows the records; the only informant
+// has id PROJECTION_INF_ID
+const char PROJECTION_MAGIC[FORMAT_MAGIC_SIZE] = {0, 'M', 'T', 'P'};
+const int PROJECTION_OFFSET_SIZE = 8;
+const bioid_t PROJECTION_INF_ID = 1;
+
+// What "slice" keeps of a store: the given reference chromosomes and
+// informants (all if none are given) and, if 'has_regions', only blocks
+// overlapping the half-open regions listed by reference chromosome
+struct SliceSelection
+{
+    std::vector<std::string> chromosomes, informants;
+    std::map<std::string, std::vector< std::pair<seqpos_t, seqpos_t> > >
+        regions;
+    bool has_regions;
+};
 
 class IOHandler
 {
@@ -29,7 +61,43 @@ class IOHandler
         std::vector<Reference*>* read_references(std::vector<IndexItem*>
                                                  &index_items,
                                                  bioid_t ref_chr_id,
-                                                 int indices[]);
+                                                 int indices[],
+                                                 std::vector<ReferenceHandle>
+                                                 &handles);
+        InformantArray* get_informant_array(bioid_t ref_chr_id,
+                                            bioid_t inf_id,
+                                            std::vector<Reference*>
+                                            &references, int first_block);
+        void convert(char header_fname[], char bin_fname[],
+                     std::map<std::string, bioid_t> &genome_map,
+                     std::vector< std::map<std::string,
+                     std::pair <bioid_t, seqpos_t> > > &chr_maps,
+                     std::map <bioid_t, std::vector<IndexItem*> > &index,
+                     bool sharded = false, bool aligned = false);
+        void add_informant(char maf_fname[],
+                           std::map<std::string, bioid_t> &genome_map,
+                           std::vector< std::map<std::string,
+                           std::pair <bioid_t, seqpos_t> > > &chr_maps,
+                           std::map <bioid_t, std::vector<IndexItem*> >
+                           &index);
+        bool is_unaligned(bioid_t ref_chr_id, bioid_t inf_id, int block);
+        bool has_summaries();
+        void extract(char out_fname[], std::string &informant,
+                     std::map<std::string, bioid_t> &genome_map,
+                     std::vector< std::map<std::string,
+                     std::pair <bioid_t, seqpos_t> > > &chr_maps,
+                     std::map <bioid_t, std::vector<IndexItem*> > &index);
+        void slice(char header_fname[], char bin_fname[],
+                   std::map<std::string, bioid_t> &genome_map,
+                   std::vector< std::map<std::string,
+                   std::pair <bioid_t, seqpos_t> > > &chr_maps,
+                   std::map <bioid_t, std::vector<IndexItem*> > &index,
+                   SliceSelection &selection, bool sharded = false);
+        static bool is_projection(const char fname[]);
+        void attach_shared_pool(const std::string &name);
+        void set_threads(unsigned threads);
+        void print_stats();
+        void print_memory();
         
     private:
         char header_fname_[1000];
@@ -37,20 +105,138 @@ class IOHandler
         bool compressed_;
         char maf_fname_[1000];
         bool map_, preprocess_, map_opened_;
+        int format_version_;
+        // Files with records, opened when first read: the BGZF/BIN file or
+        // the shards listed in its manifest. source_ is the current one.
+        std::vector<std::string> shard_fnames_;
+        std::vector<RecordSource*> shard_sources_;
+        // Shard of each reference chromosome, empty if not sharded
+        std::map <bioid_t, int> chr_shards_;
+        int shard_;
+        RecordSource* source_;
+        // Whether the store is a pairwise projection, which is read through
+        // a read-only mapping of the whole file
+        bool is_projection_;
+        // Output of preprocessing
         BGZF* bgzf_;
-        std::ifstream ibin_;
         std::ofstream obin_;
-        std::map <uint64_t, std::pair<Reference*, int> > cache_;
+        // Cached blocks by reference chromosome and pointer
+        BlockCache cache_;
         static const int max_cache_size_ = 10;
+        // Bytes taken by the tables read from the header
+        uint64_t header_bytes_;
+        // Informant arrays over cached blocks by reference chromosome and
+        // informant
+        std::map <std::pair<bioid_t, bioid_t>, InformantArray*>
+            informant_arrays_;
+        // Blocks in which an informant may have bases aligned to the
+        // reference, by reference chromosome and informant; an informant
+        // missing here has none in the chromosome. Known if 'has_coverage_'.
+        std::map <std::pair<bioid_t, bioid_t>, BitVector*> coverage_;
+        bool has_coverage_;
+        // Whether index items carry summaries of their informants
+        bool has_summaries_;
+        
+        // Pool of records shared with other processes and identities of the
+        // shards in it, NULL unless attached
+        SharedPool* pool_;
+        std::vector<uint64_t> shard_ids_;
+        // Whether the pool is deleted with this IOHandler (not a reader)
+        bool owns_pool_;
+        
+        // Number of threads decoding blocks of one query and their readers
+        // of records, created when first needed
+        unsigned threads_;
+        std::vector<IOHandler*> readers_;
+        
+        // Bytes of the record being decoded and position of the next unread
+        // byte in them
+        std::vector<char> record_;
+        size_t record_pos_;
         
+        uint64_t decode_number(const char data[], const int size);
         uint64_t bytes_to_number(std::istream &s, const int size);
-        uint64_t read_bin_number(const int size);
-        int max(int a, int b);
-        std::vector<bool>* read_bin_sequence(seqpos_t length,
-                                             std::vector<int>* rankselect =NULL,
-                                             bool selecting = true);
-        void add_to_cache(uint64_t pointer, Reference* reference);
-        Reference* get_from_cache(uint64_t pointer);
+        uint64_t read_varint(std::istream &s);
+        int64_t read_signed_varint(std::istream &s);
+        seqpos_t to_chr_length(uint64_t length);
+        BitVector* read_bit_vector(std::istream &s, seqpos_t length);
+        void read_header_v2(std::istream &s,
+                            std::map<std::string, bioid_t> &genome_map,
+                            std::vector< std::map<std::string,
+                            std::pair <bioid_t, seqpos_t> > > &chr_maps,
+                            std::map <bioid_t, std::vector<IndexItem*> >
+                            &index);
+        void read_manifest(std::map<std::string,
+                           std::pair <bioid_t, seqpos_t> > &ref_chr_map);
+        void set_record_lengths(std::map <bioid_t, std::vector<IndexItem*> >
+                                &index);
+        void select_shard(bioid_t ref_chr_id);
+        void seek_record(uint64_t pointer);
+        void fetch(size_t size);
+        bool load_record(uint64_t pointer, uint64_t length);
+        void share_record(uint64_t pointer);
+        uint64_t parse_number(const int size);
+        BitVector* parse_sequence(seqpos_t length,
+                                  std::vector<seqpos_t>* rankselect = NULL,
+                                  bool selecting = true);
+        uint64_t parse_varint();
+        int64_t parse_signed_varint();
+        BitVector* parse_bit_vector(seqpos_t length);
+        Reference* parse_record(IndexItem* index_item, bioid_t ref_chr_id);
+        Reference* parse_record_v2(IndexItem* index_item, bioid_t ref_chr_id);
+        void parse_informants_v2(Reference* reference);
+        void put_varint(std::string &out, uint64_t number);
+        void put_signed_varint(std::string &out, int64_t number);
+        void put_bit_vector(std::string &out, BitVector &bits);
+        void put_reference_v2(std::string &out, Reference* reference);
+        void put_informants_v2(std::string &out,
+                               std::vector< std::pair<bioid_t,
+                               std::vector<Informant*>*> > &infs);
+        void open_output(const std::string &fname, BGZF* &bgzf,
+                         std::ofstream &bin);
+        void close_output(BGZF* &bgzf, std::ofstream &bin);
+        uint64_t write_output(const std::string &record, BGZF* bgzf,
+                              std::ofstream &bin, const std::string &fname,
+                              bool aligned = false);
+        void put_header(std::string &out,
+                        std::map<std::string, bioid_t> &genome_map,
+                        std::vector< std::map<std::string,
+                        std::pair <bioid_t, seqpos_t> > > &chr_maps,
+                        std::map <bioid_t, std::vector<IndexItem*> >
+                        &index);
+        void write_header(const std::string &fname,
+                          std::map<std::string, bioid_t> &genome_map,
+                          std::vector< std::map<std::string,
+                          std::pair <bioid_t, seqpos_t> > > &chr_maps,
+                          std::map <bioid_t, std::vector<IndexItem*> >
+                          &index);
+        void write_records(char bin_fname[],
+                           std::map <bioid_t, std::string> &chr_names,
+                           std::map <bioid_t, bioid_t> &chr_ids,
+                           std::map <bioid_t, bioid_t> &inf_ids,
+                           std::map <bioid_t, std::vector<IndexItem*> >
+                           &index, bool sharded, bool aligned,
+                           std::set< std::pair<bioid_t, bioid_t> >
+                           *inf_chrs = NULL);
+        void append_supplements(bioid_t inf_id,
+                                std::map < std::pair<bioid_t, int>,
+                                std::vector<Informant*> > &new_blocks,
+                                std::map <bioid_t, std::vector<IndexItem*> >
+                                &index);
+        Reference* load_reference(IndexItem* index_item, bioid_t ref_chr_id);
+        IOHandler* make_reader();
+        void load_in_parallel(std::vector<IndexItem*> &index_items,
+                              bioid_t ref_chr_id, std::vector<int> &missing,
+                              std::vector<ReferenceHandle> &loaded,
+                              std::vector<ReferenceHandle> &evicted);
+        void drop_evicted(std::vector<ReferenceHandle> &evicted);
+        uint64_t count_header_bytes(std::map<std::string, bioid_t>
+                                    &genome_map,
+                                    std::vector< std::map<std::string,
+                                    std::pair <bioid_t, seqpos_t> > >
+                                    &chr_maps,
+                                    std::map <bioid_t,
+                                    std::vector<IndexItem*> > &index);
 
 };
 
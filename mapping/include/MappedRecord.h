@@ -0,0 +1,152 @@
+#ifndef MAPPEDRECORD_H
+#define MAPPEDRECORD_H
+
+// Binary output of "maptool bed --binary". This header depends on nothing
+// else in maptool, so that downstream tools can include it to read the
+// output without parsing text.
+//
+// The output starts with MAPPED_MAGIC, a 32-bit version, the table of
+// informant chromosomes (32-bit count, then for each one a 32-bit id,
+// a 32-bit name length and the name) and the table of error names (32-bit
+// count, then for each one a 32-bit length and the name). Then there is
+// a MappedRecord for each mapped or failed input line and configuration,
+// each followed by 'exon_count' pairs of 64-bit exon offsets from 'start'
+// and exon lengths. Numbers are little-endian, records have no padding.
+
+#include <cstdint>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <map>
+#include <stdexcept>
+
+const char MAPPED_MAGIC[4] = {0, 'M', 'T', 'B'};
+const uint32_t MAPPED_VERSION = 1;
+// Error code of a line which failed without a known error
+const uint8_t MAPPED_UNKNOWN_ERROR = 255;
+
+struct MappedRecord
+{
+    // Index of the input line from 0, empty lines included
+    uint64_t line;
+    // Half-closed mapped interval, both 0 if the line failed to map, and
+    // thick interval, both -1 if there is none (always if the line failed)
+    int64_t start, end, thick_start, thick_end;
+    uint32_t chr_id;
+    uint32_t exon_count;
+    // Index of the configuration given by --configs, 0 without it
+    uint16_t config;
+    // 1 for '+', 0 for '-'
+    uint8_t strand;
+    // 0 if the line was mapped, otherwise index of its first error in the
+    // table of error names plus 1, or MAPPED_UNKNOWN_ERROR
+    uint8_t error;
+    uint32_t reserved;
+};
+
+static_assert(sizeof(MappedRecord) == 56, "MappedRecord must have no padding");
+static_assert((offsetof(MappedRecord, start) == 8) &&
+              (offsetof(MappedRecord, thick_end) == 32) &&
+              (offsetof(MappedRecord, chr_id) == 40) &&
+              (offsetof(MappedRecord, exon_count) == 44) &&
+              (offsetof(MappedRecord, config) == 48) &&
+              (offsetof(MappedRecord, strand) == 50) &&
+              (offsetof(MappedRecord, error) == 51) &&
+              (offsetof(MappedRecord, reserved) == 52),
+              "MappedRecord fields must be where the format puts them");
+
+// Convert a number between the byte order of this machine and the
+// little-endian order of the output, which is the same both ways
+template <class T>
+inline T mapped_order(T number)
+{
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    T swapped;
+    const char* from = (const char*)&number;
+    char* to = (char*)&swapped;
+    for (size_t i = 0; i < sizeof(T); ++i) to[i] = from[sizeof(T) - 1 - i];
+    return swapped;
+#else
+    return number;
+#endif
+}
+
+// Convert all numbers of the record by mapped_order
+inline void mapped_order(MappedRecord &record)
+{
+    record.line = mapped_order(record.line);
+    record.start = mapped_order(record.start);
+    record.end = mapped_order(record.end);
+    record.thick_start = mapped_order(record.thick_start);
+    record.thick_end = mapped_order(record.thick_end);
+    record.chr_id = mapped_order(record.chr_id);
+    record.exon_count = mapped_order(record.exon_count);
+    record.config = mapped_order(record.config);
+    record.reserved = mapped_order(record.reserved);
+}
+
+// Reader of the binary output, reads the tables in the constructor
+class MappedReader
+{
+    public:
+        explicit MappedReader(FILE* file): file_(file)
+        {
+            char magic[4];
+            if ((fread(magic, 1, 4, file_) != 4) ||
+                (memcmp(magic, MAPPED_MAGIC, 4) != 0) ||
+                (read_number() != MAPPED_VERSION))
+            {
+                throw std::runtime_error("Not a maptool binary output");
+            }
+            for (uint32_t count = read_number(); count > 0; --count)
+            {
+                uint32_t chr_id = read_number();
+                chromosomes[chr_id] = read_string();
+            }
+            for (uint32_t count = read_number(); count > 0; --count)
+                error_names.push_back(read_string());
+        }
+        
+        // Read the next record and its exons, return false at the end
+        bool read(MappedRecord &record, std::vector<int64_t> &exons)
+        {
+            if (fread(&record, sizeof(record), 1, file_) != 1) return false;
+            mapped_order(record);
+            exons.resize(2 * record.exon_count);
+            if (exons.empty()) return true;
+            if (fread(&exons[0], sizeof(int64_t), exons.size(), file_) !=
+                exons.size())
+            {
+                throw std::runtime_error("Truncated maptool binary output");
+            }
+            for (auto it = exons.begin(); it != exons.end(); ++it)
+                *it = mapped_order(*it);
+            return true;
+        }
+        
+        // Informant chromosome names by id
+        std::map<uint32_t, std::string> chromosomes;
+        std::vector<std::string> error_names;
+        
+    private:
+        FILE* file_;
+        
+        uint32_t read_number()
+        {
+            uint32_t number;
+            if (fread(&number, sizeof(number), 1, file_) != 1)
+                throw std::runtime_error("Truncated maptool binary output");
+            return mapped_order(number);
+        }
+        std::string read_string()
+        {
+            std::string s(read_number(), '\0');
+            if (!s.empty() && (fread(&s[0], 1, s.size(), file_) != s.size()))
+                throw std::runtime_error("Truncated maptool binary output");
+            return s;
+        }
+};
+
+#endif /* MAPPEDRECORD_H */
@@ -2,6 +2,8 @@
 #define MAPPING_H
 
 #include <map>
+#include <unordered_map>
+#include <deque>
 #include <string>
 #include <vector>
 #include <stdexcept>
@@ -22,11 +24,67 @@ class MappingError: public std::runtime_error
             std::runtime_error(other) { }
 };
 
+// Mapping of one endpoint of a queried interval to the informant
+class MappedPosition
+{
+    public:
+        MappedPosition(seqpos_t position, int way, bool is_end)
+        : position(position), way(way), is_end(is_end), located(false),
+        chr_id(0), strand(false), inf_pos(0), gap(0), inf_block(0),
+        inf_index(0), ref_block(0), error("")
+        {};
+        
+        seqpos_t position;
+        int way;
+        // Whether this is the end of its interval (decides which reference
+        // a position between two references belongs to)
+        bool is_end, located;
+        std::vector<Reference*>::iterator ref_it;
+        std::vector<Informant*>::iterator inf_it;
+        bioid_t chr_id;
+        bool strand;
+        seqpos_t inf_pos, gap;
+        // Block of the chromosome holding 'inf_it' and index of 'inf_it'
+        // among the block's informants
+        int inf_block;
+        unsigned inf_index;
+        // Block of the chromosome holding 'ref_it'
+        int ref_block;
+        // Name of the error encountered while mapping, empty on success
+        std::string error;
+};
+
+// Endpoint mapped by a previous query: reference chromosome, position,
+// direction and which end of an interval it is
+struct EndpointKey
+{
+    bioid_t chr_id;
+    seqpos_t position;
+    int way;
+    bool is_end;
+    
+    bool operator==(const EndpointKey &other) const
+    {
+        return (chr_id == other.chr_id) && (position == other.position) &&
+               (way == other.way) && (is_end == other.is_end);
+    }
+};
+
+struct EndpointKeyHash
+{
+    size_t operator()(const EndpointKey &key) const
+    {
+        uint64_t h = (uint64_t)key.position * 0x9e3779b97f4a7c15ULL;
+        h ^= ((uint64_t)key.chr_id << 2) | ((key.way == 1) << 1) | key.is_end;
+        return h ^ (h >> 29);
+    }
+};
+
 class Mapping
 {
     public:
         Mapping(IOHandler* ioh, std::string &informant, int inf_maxgap,
-                int ref_maxgap, bool inner, bool alwaysmap,
+                int ref_maxgap, bool inner, bool alwaysmap, bool sparse,
                 std::map<std::string, bioid_t> *genome_map,
                 std::vector< std::map<std::string,
                 std::pair <bioid_t, seqpos_t> > > *chr_maps,
@@ -37,7 +95,11 @@ class Mapping
         void set_query(BedQuery* qry);
         BedQuery* get_answer();
         
-        void print_errors();
+        void print_errors(const std::string &prefix = "");
+        int get_error_code();
+        std::vector<std::string> get_error_names();
+        void print_stats(const std::string &prefix = "");
+        void print_memory(const std::string &prefix = "");
         void delete_old();
     
     private:
@@ -47,19 +109,33 @@ class Mapping
         bioid_t ref_chr_id_;
         int inf_maxgap_, ref_maxgap_;
         bool inner_, alwaysmap_;
+        // Whether blocks between endpoints are skipped where possible, and
+        // whether they are for the current query
+        bool sparse_, sparse_query_;
         BedQuery *query_, *answer_, *thick_answer_;
         std::vector<Reference*>* references_;
+        // Handles keeping blocks read for the query from being evicted
+        std::vector<ReferenceHandle> pinned_;
+        // Index of the first of references_ in the chromosome's index
+        int first_block_;
+        InformantArray* inf_array_;
         std::vector<BedQuery*> exons_;
+        std::vector<MappedPosition> endpoints_;
+        // Summaries of informants of each endpoint's block from the endpoint
+        // up to the other one of the interval or to the end of the block,
+        // used by the sparse mode
+        std::vector<BlockSummary> pieces_;
         std::map<std::string, bioid_t> *genome_map_;
         std::vector< std::map<std::string,
                     std::pair <bioid_t, seqpos_t> > > *chr_maps_;
         std::map <bioid_t, std::vector<IndexItem*> > *index_;
         std::map <bioid_t, std::pair <std::string, seqpos_t> > *id_to_len_;
         std::vector < std::string > errors_;
-        static const int known_error_count_ = 10;
+        static const int known_error_count_ = 11;
         std::string known_error_names_[known_error_count_] = {"no_mapping",
             "pos_to_gap", "inf_preceed", "inf_strand", "inf_contig", "inf_gap",
-            "invalid_query", "no_exon_mapping", "no_thick_mapping", "ref_gap"
+            "invalid_query", "no_exon_mapping", "no_thick_mapping", "ref_gap",
+            "unknown_chr"
         };
         std::string known_error_messages_[known_error_count_] = {
             "There is no mapping of the interval (maybe try --outer?)",
@@ -73,34 +149,48 @@ class Mapping
                 "(could be overriden by -alwaysmap)",
             "There is no mapping of the thick region "
                 "(could be overriden by -alwaysmap)",
-            "In reference: there is a gap of width "};
-        int found_gap_ = 0;
+            "In reference: there is a gap of width ",
+            "The chromosome is not in the store"};
+        seqpos_t found_gap_ = 0;
+        // Endpoints mapped successfully by previous queries, the oldest ones
+        // are forgotten first. Informant and maxgaps are fixed for a Mapping,
+        // so they are not part of the key.
+        std::unordered_map<EndpointKey, MappedPosition, EndpointKeyHash>
+            memo_;
+        std::deque<EndpointKey> memo_order_;
+        static const unsigned memo_size_ = 1 << 16;
+        uint64_t memo_hits_ = 0, memo_misses_ = 0;
+        // Most bytes taken by structures of one query
+        uint64_t query_peak_bytes_ = 0;
         
-        std::vector<Reference*>* get_references(seqpos_t start, seqpos_t end);
-        BedQuery* map_position(std::vector <Reference*> &references,
-                               std::vector<Informant*> &informants,
-                               seqpos_t position, int way,
-                               std::vector<Reference*>::iterator &ref_it,
-                               std::vector<Informant*>::iterator &inf_it_ret);
+        void find_blocks(seqpos_t start, seqpos_t end, int indices[]);
+        std::vector<Reference*>* get_references(int indices[]);
+        template <int way>
+        void map_position(std::vector <Reference*> &references,
+                          MappedPosition &mapped, unsigned &seg_cursor);
+        void map_position(std::vector <Reference*> &references,
+                          MappedPosition &mapped, unsigned &seg_cursor);
         seqpos_t min(seqpos_t x, seqpos_t y);
         seqpos_t max(seqpos_t x, seqpos_t y);
-        bool check_informants(std::vector<Informant*>::iterator &inf_it1,
-                              std::vector<Informant*>::iterator &inf_it2);
-        BedQuery* get_mapping(seqpos_t start, seqpos_t end,
-                              std::vector<Reference*> &references,
-                              std::vector<Informant*> &informants,
-                              std::vector<Reference*>::iterator &ref_it1,
-                              std::vector<Reference*>::iterator &ref_it2);
+        bool check_informants(std::vector<Informant*>::iterator inf_it1,
+                              std::vector<Informant*>::iterator inf_it2,
+                              int inf_maxgap);
+        bool check_step(const BlockSummary &last, const BlockSummary &next,
+                        int inf_maxgap);
+        bool is_valid(const BlockSummary &summary, int inf_maxgap);
+        void add_endpoints(seqpos_t start, seqpos_t end);
+        void add_query_endpoints(bool thick);
+        void map_endpoints();
+        bool map_sparse_endpoints(int indices[]);
+        int check_pieces(unsigned first, int inf_maxgap);
+        void memoize(const EndpointKey &key, MappedPosition &mapped);
+        uint64_t query_bytes();
+        BedQuery* get_mapping(unsigned first, int inf_maxgap,
+                              std::string location_error);
+        BedQuery* merge_endpoints(MappedPosition &start, MappedPosition &end);
+        bool map_intervals(bool thick);
         std::string get_error_message(std::string error_name);
         void error(std::string error_name="");
-        void set_ref_iterators(seqpos_t start, seqpos_t end,
-                               std::vector<Reference*> &references,
-                               std::vector<Reference*>::iterator &ref_it1,
-                               std::vector<Reference*>::iterator &ref_it2);
-        void fill_informant_vector(std::vector<Reference*> &references,
-                                   std::vector<Informant*> &informants);
-        seqpos_t get_inf_count(std::vector<Reference*>::iterator &from,
-                               const std::vector<Reference*>::iterator &to);
 };
 
 #endif /* MAPPING_H */
\ No newline at end of file
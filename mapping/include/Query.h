@@ -3,6 +3,7 @@
 
 #include <string>
 #include <vector>
+#include <utility>
 
 #include "Sequence.h"
 
@@ -15,18 +16,33 @@ class IndexItem
         IndexItem(bool strand, seqpos_t chr_pos, seqpos_t bases_count,
             uint64_t pointer)
         : strand_(strand), chr_pos_(chr_pos), bases_count_(bases_count),
-        pointer_(pointer) {};
+        pointer_(pointer), record_length_(0) {};
         
         bool get_strand();
         seqpos_t get_chr_pos();
         seqpos_t get_bases_count();
         uint64_t get_pointer();
+        uint64_t get_record_length();
+        void set_record_length(uint64_t record_length);
+        void set_pointer(uint64_t pointer);
+        std::vector< std::pair<uint64_t, uint64_t> >& get_supplements();
+        void add_supplement(uint64_t pointer, uint64_t length);
+        std::vector<BlockSummary>& get_summaries();
+        BlockSummary* find_summary(bioid_t inf_id);
+        uint64_t memory_usage();
         
     private:
         bool strand_;
         seqpos_t chr_pos_;
         seqpos_t bases_count_;
         uint64_t pointer_;
+        // Length of the record in bytes, 0 if unknown
+        uint64_t record_length_;
+        // Pointers and lengths of records with informants added later
+        std::vector< std::pair<uint64_t, uint64_t> > supplements_;
+        // Summaries of informants aligned to the block, by ascending
+        // informant id
+        std::vector<BlockSummary> summaries_;
 };
 
 class BedQuery
@@ -0,0 +1,71 @@
+#ifndef RECORDSOURCE_H
+#define RECORDSOURCE_H
+
+#include <string>
+#include <fstream>
+#include <cstdint>
+#include <cstddef>
+
+#include "../../../ocaml-bgzf/bgzf.h"
+
+// Records of one file. IOHandler picks the kind of the file once, when it
+// opens the file, and then reads through this interface: seek(pointer) to
+// the start of a record and read(data, size) of its next bytes, both
+// throwing std::runtime_error if the file can not be read. A new kind of
+// file needs nothing else.
+class RecordSource
+{
+    public:
+        virtual ~RecordSource() {};
+        
+        virtual void seek(uint64_t pointer) = 0;
+        virtual void read(char* data, size_t size) = 0;
+};
+
+// BGZF file, pointers are its virtual offsets
+class BgzfSource : public RecordSource
+{
+    public:
+        explicit BgzfSource(const std::string &fname);
+        ~BgzfSource();
+        
+        void seek(uint64_t pointer);
+        void read(char* data, size_t size);
+        
+    private:
+        std::string fname_;
+        BGZF* bgzf_;
+};
+
+// Uncompressed binary file
+class FileSource : public RecordSource
+{
+    public:
+        explicit FileSource(const std::string &fname);
+        
+        void seek(uint64_t pointer);
+        void read(char* data, size_t size);
+        
+    private:
+        std::string fname_;
+        std::ifstream file_;
+};
+
+// Read-only mapping of a whole file (e.g. a pairwise projection), records
+// are copied out of it without any system call
+class MappedSource : public RecordSource
+{
+    public:
+        explicit MappedSource(const std::string &fname);
+        ~MappedSource();
+        
+        void seek(uint64_t pointer);
+        void read(char* data, size_t size);
+        
+    private:
+        std::string fname_;
+        const char* data_;
+        uint64_t size_, pos_;
+};
+
+#endif /* RECORDSOURCE_H */
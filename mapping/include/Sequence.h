@@ -4,28 +4,43 @@
 #include <vector>
 #include <map>
 #include <cstdint>
+#include <mutex>
+#include <atomic>
 
 #include <iostream>
 
-typedef uint16_t bioid_t;
+#include "BitVector.h"
+
+typedef uint32_t bioid_t;
+// Coordinates, 32-bit in a build with MAPTOOL_COORD32 defined (make
+// COORD32=1) for genomes whose sequences are shorter than 2^31 bases
+#ifdef MAPTOOL_COORD32
+typedef int32_t seqpos_t;
+#else
 typedef int64_t seqpos_t;
-typedef uint16_t biocount_t;
+#endif
+typedef uint32_t biocount_t;
 
-const int BIOID_SIZE = 2, SEQPOS_SIZE = 8, BIOCOUNT_SIZE = 2, STRAND_SIZE = 1,
+const int BIOID_SIZE = 4, SEQPOS_SIZE = 8, BIOCOUNT_SIZE = 4, STRAND_SIZE = 1,
     FILE_OFFSET_SIZE = 8, NAME_SIZE = 100, SELECT_BITS = 32, RANK_BITS = 32;
 const int OLD_BIOID_SIZE1 = 1, OLD_BIOID_SIZE2 = 2, OLD_BIOCOUNT_SIZE1 = 1,
     OLD_SEQPOS_SIZE = 4, OLD_BIOCOUNT_SIZE2 = 4;
+// Approximate bytes taken by a node of std::map besides its value
+const uint64_t MAP_NODE_SIZE = 4 * sizeof(void*);
+// Size of the fixed part of an informant block in a record
+const int OLD_BLOCK_HEADER_SIZE = OLD_BIOID_SIZE2 + STRAND_SIZE +
+    4*OLD_SEQPOS_SIZE;
 
 
 class Sequence
 {
     public:
-        Sequence(std::vector<bool>* sequence, bioid_t chr_id, seqpos_t chr_pos,
+        Sequence(BitVector* sequence, bioid_t chr_id, seqpos_t chr_pos,
                  bool strand, seqpos_t bases_count)
         : sequence_(sequence), chr_id_(chr_id), chr_pos_(chr_pos),
         strand_(strand), bases_count_(bases_count)
         {};
-        Sequence(std::vector<bool>* sequence, std::vector<int>* rankselect,
+        Sequence(BitVector* sequence, std::vector<seqpos_t>* rankselect,
                  bioid_t chr_id, seqpos_t chr_pos, bool strand,
                  seqpos_t bases_count)
         : sequence_(sequence), rankselect_(rankselect), chr_id_(chr_id),
@@ -36,17 +51,19 @@ class Sequence
         
         virtual ~Sequence();
         
-        void add_sequence(std::vector<bool>* sequence);
-        std::vector<bool>* get_sequence();
+        void add_sequence(BitVector* sequence);
+        BitVector* get_sequence();
+        std::vector<seqpos_t>* get_rankselect();
         seqpos_t get_chr_pos();
         seqpos_t get_bases_count();
-        seqpos_t get_chr_id();
+        bioid_t get_chr_id();
         bool get_strand();
         seqpos_t length();
         virtual void print_info();
         virtual void print_seq();
-        int select(int number);
-        int rank(seqpos_t seq_pos);
+        seqpos_t select(seqpos_t number);
+        seqpos_t rank(seqpos_t seq_pos);
+        virtual uint64_t memory_usage();
         seqpos_t min(seqpos_t x, seqpos_t y);
         seqpos_t max(seqpos_t x, seqpos_t y);
         
@@ -54,8 +71,8 @@ class Sequence
         char* to_bytes();
         
     private:
-        std::vector<bool>* sequence_;
-        std::vector<int>* rankselect_;
+        BitVector* sequence_;
+        std::vector<seqpos_t>* rankselect_;
         bioid_t chr_id_;
         seqpos_t chr_pos_;
         bool strand_, has_rankselect_ = false;
@@ -64,16 +81,44 @@ class Sequence
 
 class Reference;
 
+// Maximal ungapped piece of the alignment of a reference block to one
+// informant: reference positions ref_pos .. ref_pos+length-1 correspond to
+// informant positions inf_pos .. inf_pos+length-1
+class Segment
+{
+    public:
+        Segment(seqpos_t ref_pos, seqpos_t inf_pos, seqpos_t length,
+                bool strand, unsigned inf_index)
+        : ref_pos(ref_pos), inf_pos(inf_pos), length(length), strand(strand),
+        inf_index(inf_index)
+        {};
+        
+        seqpos_t ref_pos, inf_pos, length;
+        bool strand;
+        // Index of the Informant (within its Reference) the segment belongs to
+        unsigned inf_index;
+};
+
+// Ungapped segments of the alignment of a reference to one informant
+// genome, built on first use; 'segments' is set once they are built
+struct SegmentIndex
+{
+    SegmentIndex(): segments(NULL) {};
+    
+    std::once_flag built;
+    std::atomic<std::vector<Segment>*> segments;
+};
+
 class Informant: public Sequence
 {
     public:
-        Informant(std::vector<bool>* sequence, bioid_t chr_id, seqpos_t chr_pos,
+        Informant(BitVector* sequence, bioid_t chr_id, seqpos_t chr_pos,
                   bool strand, seqpos_t bases_count, seqpos_t seq_pos)
         : Sequence(sequence, chr_id, chr_pos, strand, bases_count)
         {
             seq_pos_ = seq_pos;
         }
-        Informant(std::vector<bool>* sequence, bioid_t chr_id, seqpos_t chr_pos,
+        Informant(BitVector* sequence, bioid_t chr_id, seqpos_t chr_pos,
                   bool strand, seqpos_t bases_count, seqpos_t seq_pos,
                   Reference* aligned_to)
         : Sequence(sequence, chr_id, chr_pos, strand, bases_count)
@@ -81,7 +126,7 @@ class Informant: public Sequence
             seq_pos_ = seq_pos;
             aligned_to_ = aligned_to;
         }
-        Informant(std::vector<bool>* sequence, std::vector<int>* rank,
+        Informant(BitVector* sequence, std::vector<seqpos_t>* rank,
                   bioid_t chr_id, seqpos_t chr_pos, bool strand,
                   seqpos_t bases_count, seqpos_t seq_pos, Reference* aligned_to)
         : Sequence(sequence, rank, chr_id, chr_pos, strand, bases_count)
@@ -93,7 +138,9 @@ class Informant: public Sequence
         void print_info();
         seqpos_t get_seq_pos();
         Reference* get_ref();
-        bool find_aligned_one(int way, int &jinf, int &jref);
+        template <int way>
+        bool find_aligned_one(seqpos_t &jinf, seqpos_t &jref);
+        uint64_t memory_usage();
         
         //TODO: implement or delete this
         char* to_bytes();
@@ -102,15 +149,37 @@ class Informant: public Sequence
         Reference* aligned_to_;
 };
 
+// Summary of informants first .. last of one genome in one block: where the
+// first one starts, where the last one ends, whether each of them correctly
+// precedes the next one on the same strand and contig, and the largest gaps
+// between them (at least 0)
+class BlockSummary
+{
+    public:
+        BlockSummary()
+        : inf_id(0), chr_id(0), strand(false), ordered(true),
+        first_chr_pos(0), first_seq_pos(0), last_inf_end(0), last_ref_end(0),
+        max_inf_gap(0), max_ref_gap(0)
+        {};
+        BlockSummary(bioid_t inf_id, std::vector<Informant*>::iterator first,
+                     std::vector<Informant*>::iterator last);
+        
+        bioid_t inf_id, chr_id;
+        // Strand and contig of the first informant
+        bool strand, ordered;
+        seqpos_t first_chr_pos, first_seq_pos, last_inf_end, last_ref_end;
+        seqpos_t max_inf_gap, max_ref_gap;
+};
+
 class Reference: public Sequence
 {
     public:
-        Reference(std::vector<bool>* sequence, bioid_t chr_id, seqpos_t chr_pos,
+        Reference(BitVector* sequence, bioid_t chr_id, seqpos_t chr_pos,
                  bool strand, seqpos_t bases_count)
         : Sequence(sequence, chr_id, chr_pos, strand, bases_count)
         {};
         
-        Reference(std::vector<bool>* sequence, std::vector<int>* select,
+        Reference(BitVector* sequence, std::vector<seqpos_t>* select,
                   bioid_t chr_id, seqpos_t chr_pos, bool strand,
                   seqpos_t bases_count)
         : Sequence(sequence, select, chr_id, chr_pos, strand, bases_count)
@@ -119,20 +188,59 @@ class Reference: public Sequence
         ~Reference();
         
         std::vector<Informant*>* get_informant_vector(bioid_t inf_id);
+        std::vector<bioid_t> get_informant_ids();
         void add_informant(bioid_t inf_id, Informant* informant);
         void print_info();
+        template <int way>
         bool find_informant(/*std::vector<Informant*>::iterator &inf_it,*/
                             seqpos_t &inf_index,
-                            bioid_t inf_id, seqpos_t seq_pos, int way);
+                            bioid_t inf_id, seqpos_t seq_pos);
         bool find_aligned_one(std::vector<Informant*>::iterator &inf_it,
                               bioid_t inf_id, seqpos_t seq_pos, int way,
                               seqpos_t &inf_seq_pos);
+        std::vector<Segment>* get_segments(bioid_t inf_id);
+        template <int way>
+        bool find_segment(unsigned &seg_index, bioid_t inf_id,
+                          seqpos_t position, unsigned &cursor);
+        uint64_t memory_usage();
         
         //TODO: implement or delete this
         char* to_bytes();
         
     private:
+        // Both maps get their keys only while the block is loaded; the
+        // segments of an informant are built once, by the first thread
+        // asking for them, and the maps are never modified afterwards
         std::map<bioid_t, std::vector<Informant*> > informants_;
+        std::map<bioid_t, SegmentIndex> segments_;
+        
+        std::vector<Segment>* build_segments(bioid_t inf_id);
+};
+
+// Informants of one informant genome aligned to a window of consecutive
+// blocks of one reference chromosome, stored in one array; informants of
+// block b start at get_block(b)
+class InformantArray
+{
+    public:
+        InformantArray(): first_block_(0), offsets_(1, 0) {};
+        
+        int first_block();
+        int end_block();
+        std::vector<Informant*>::iterator get_block(int block);
+        void extend(int first_block, std::vector<Reference*> &references,
+                    bioid_t inf_id);
+        void remove(Reference* reference);
+        void clear();
+        uint64_t memory_usage();
+        
+    private:
+        int first_block_;
+        std::vector<Reference*> references_;
+        std::vector<Informant*> informants_;
+        // offsets_[i] is the index in informants_ of the first informant of
+        // block first_block_+i, the last item is the size of informants_
+        std::vector<seqpos_t> offsets_;
 };
 
 #endif /* SEQUENCE_H */
\ No newline at end of file
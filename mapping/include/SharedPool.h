@@ -0,0 +1,74 @@
+#ifndef SHAREDPOOL_H
+#define SHAREDPOOL_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <atomic>
+
+#include <pthread.h>
+
+// Default size of a shared pool in bytes
+const uint64_t SHARED_POOL_SIZE = (uint64_t)256 << 20;
+
+// Records read from BGZF files, kept in POSIX shared memory so that all
+// processes attached to the pool of the same name reuse what any of them has
+// inflated. Records are found by the file they come from and their pointer
+// in it; the oldest ones are overwritten when the pool is full.
+class SharedPool
+{
+    public:
+        SharedPool(const std::string &name, uint64_t size = SHARED_POOL_SIZE);
+        ~SharedPool();
+        
+        bool get(uint64_t file_id, uint64_t pointer, std::vector<char> &data);
+        void put(uint64_t file_id, uint64_t pointer, const char* data,
+                 uint64_t length);
+        uint64_t get_hits();
+        uint64_t get_misses();
+        static uint64_t file_id(const std::string &fname);
+        
+    private:
+        // Start of the shared memory, the slots and the arena follow it
+        struct Header
+        {
+            uint64_t magic;
+            uint64_t size, slot_count, arena_size;
+            // Arena is a ring of entries from 'tail' to 'head', 'used' bytes
+            uint64_t head, tail, used;
+            pthread_mutex_t lock;
+        };
+        // Record in the arena, one slot per hash of its file and pointer
+        struct Slot
+        {
+            uint64_t file_id, pointer, offset, length;
+        };
+        // Arena entry preceding the bytes of a record
+        struct Entry
+        {
+            uint64_t slot, length;
+        };
+        static const uint64_t MAGIC = 0x6c6f6f7074616d00ULL;
+        static const uint64_t PAD_SLOT = ~(uint64_t)0;
+        // Entries are aligned to ENTRY_ALIGN bytes
+        static const uint64_t ENTRY_ALIGN = sizeof(Entry);
+        
+        std::string name_;
+        uint64_t size_;
+        Header* header_;
+        Slot* slots_;
+        char* arena_;
+        // Counted by all threads using the pool
+        std::atomic<uint64_t> hits_, misses_;
+        // Set when the pool could not be locked
+        std::atomic<bool> failed_;
+        
+        void initialize();
+        bool lock();
+        void unlock();
+        uint64_t slot_of(uint64_t file_id, uint64_t pointer);
+        uint64_t allocate(uint64_t need);
+        void evict();
+};
+
+#endif /* SHAREDPOOL_H */
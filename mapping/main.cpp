@@ -4,8 +4,13 @@
 #include <vector>
 #include <string>
 #include <utility>
+#include <algorithm>
 #include <cstring>
 #include <cstdlib>
+#include <csignal>
+#include <stdexcept>
+
+#include <sys/resource.h>
 
 using std::map;
 using std::vector;
@@ -22,9 +27,23 @@ using std::endl;
 #include "include/Query.h"
 #include "include/IOHandler.h"
 #include "include/Mapping.h"
+#include "include/BedReader.h"
+#include "include/BinaryWriter.h"
 
 const int WRONG_ARGNUM = 1, USAGE_ALL = 0, USAGE_PREP = 1, USAGE_BED = 2,
-    USAGE_INFO = 3, FILE_INACCESSIBLE = 2, WRONG_ARGS = 3;
+    USAGE_INFO = 3, USAGE_CONVERT = 4, USAGE_ADD_INFORMANT = 5,
+    USAGE_REPACK = 6, USAGE_EXTRACT = 7, USAGE_SLICE = 8, FILE_INACCESSIBLE = 2,
+    WRONG_ARGS = 3;
+
+// Settings of one mapping configuration evaluated by "bed", 'tag' prefixes
+// its output lines if there are several
+struct MappingConfig
+{
+    std::string tag;
+    bool inner;
+    int maxgap;
+    bool alwaysmap;
+};
 
 bool check_file_existence(char filename[])
 {
@@ -57,12 +76,46 @@ bool print_error(int error, int usage=USAGE_ALL, void* message = NULL)
         if (usage == USAGE_BED || usage == USAGE_ALL)
         {
             std::cerr << "./maptool bed <header.bin> <compressed.bgzf> "
-                "<informant> [--maxgap N] [--outer] [--alwaysmap]" << endl;
+                "<informant> [--maxgap N] [--outer] [--alwaysmap] "
+                "[--sparse] [--stats] [--shared-pool NAME] "
+                "[--configs inner|outer:N[:alwaysmap],...] "
+                "[--input FILE] [--binary] [--threads N]" << endl;
+            std::cerr << "./maptool bed <projection.pmap> <informant> "
+                "[options as above]" << endl;
         }
         if (usage == USAGE_INFO || usage == USAGE_ALL)
         {
             std::cerr << "./maptool info <header.bin>" << endl;
         }
+        if (usage == USAGE_CONVERT || usage == USAGE_ALL)
+        {
+            std::cerr << "./maptool convert <header.bin> <compressed.bgzf> "
+                "<new_header.bin> <new_compressed.bgzf> [--uncompressed] "
+                "[--sharded]" << endl;
+        }
+        if (usage == USAGE_REPACK || usage == USAGE_ALL)
+        {
+            std::cerr << "./maptool repack <header.bin> <compressed.bgzf> "
+                "<new_header.bin> <new_compressed.bgzf> [--uncompressed] "
+                "[--sharded]" << endl;
+        }
+        if (usage == USAGE_EXTRACT || usage == USAGE_ALL)
+        {
+            std::cerr << "./maptool extract <header.bin> <compressed.bgzf> "
+                "<informant> <projection.pmap> [--uncompressed]" << endl;
+        }
+        if (usage == USAGE_SLICE || usage == USAGE_ALL)
+        {
+            std::cerr << "./maptool slice <header.bin> <compressed.bgzf> "
+                "<new_header.bin> <new_compressed.bgzf> "
+                "[--chromosomes LIST] [--regions FILE] [--informants LIST] "
+                "[--uncompressed] [--sharded]" << endl;
+        }
+        if (usage == USAGE_ADD_INFORMANT || usage == USAGE_ALL)
+        {
+            std::cerr << "./maptool add-informant <header.bin> "
+                "<compressed.bgzf> <pairwise.maf> [--uncompressed]" << endl;
+        }
     }
     else if (error == FILE_INACCESSIBLE)
     {
@@ -71,52 +124,179 @@ bool print_error(int error, int usage=USAGE_ALL, void* message = NULL)
     return false;
 }
 
+// Parse comma-separated configurations "inner|outer:maxgap[:alwaysmap]"
+bool parse_configs(const char list[], vector<MappingConfig> &configs)
+{
+    string rest(list);
+    while (true)
+    {
+        size_t comma = rest.find(',');
+        MappingConfig config;
+        config.tag = rest.substr(0, comma);
+        config.alwaysmap = false;
+        size_t colon1 = config.tag.find(':');
+        if (colon1 == string::npos) return false;
+        string way = config.tag.substr(0, colon1);
+        if ((way.compare("inner") != 0) && (way.compare("outer") != 0))
+            return false;
+        config.inner = (way.compare("inner") == 0);
+        size_t colon2 = config.tag.find(':', colon1 + 1);
+        string maxgap = config.tag.substr(colon1 + 1, colon2 - colon1 - 1);
+        char* end;
+        config.maxgap = strtol(maxgap.c_str(), &end, 10);
+        if (maxgap.empty() || (*end != '\0')) return false;
+        if (colon2 != string::npos)
+        {
+            if (config.tag.compare(colon2 + 1, string::npos, "alwaysmap") != 0)
+                return false;
+            config.alwaysmap = true;
+        }
+        configs.push_back(config);
+        if (comma == string::npos) return true;
+        rest.erase(0, comma + 1);
+    }
+}
+
+// Split comma-separated names
+void split_list(const char list[], vector<string> &names)
+{
+    string rest(list);
+    while (true)
+    {
+        size_t comma = rest.find(',');
+        if (comma != 0) names.push_back(rest.substr(0, comma));
+        if (comma == string::npos) return;
+        rest.erase(0, comma + 1);
+    }
+}
+
+// Read regions of "slice" from a BED file, which may be compressed
+void read_regions(const char fname[], SliceSelection &selection)
+{
+    BedReader input(fname);
+    string bedline;
+    while (input.get_line(bedline))
+    {
+        if (bedline.empty() || (bedline[0] == '#') ||
+            (bedline.compare(0, 5, "track") == 0) ||
+            (bedline.compare(0, 7, "browser") == 0))
+        {
+            continue;
+        }
+        BedQuery region(bedline);
+        if (region.get_end() < region.get_start())
+        {
+            throw std::runtime_error("Invalid line in " + string(fname) +
+                                     ": " + bedline);
+        }
+        selection.regions[region.get_chr()].push_back(
+            std::make_pair(region.get_start(), region.get_end()));
+    }
+    selection.has_regions = true;
+}
+
 bool parse_options(char* opt[], int optnum, char command[], char file1[],
-    char file2[], char file3[], char informant[], int &maxgap, bool &inner,
-    bool &alwaysmap, bool &compressed)
+    char file2[], char file3[], char out_file1[], char out_file2[],
+    char pairwise_maf[], char informant[], int &maxgap, bool &inner,
+    bool &alwaysmap, bool &compressed, bool &sharded, bool &sparse,
+    bool &stats, char pool_name[], vector<MappingConfig> &configs,
+    char input_fname[], bool &binary, int &threads,
+    SliceSelection &selection)
 {
     strcpy(file3, "");
     if (optnum <= 1) return false;
     if (strcmp(opt[1], "bed") == 0)
     {
-        if (optnum < 5 || optnum > 10)
+        // A pairwise projection replaces both the header and BGZF file
+        int first = 5;
+        if ((optnum > 2) && IOHandler::is_projection(opt[2])) first = 4;
+        if (optnum < first || optnum > first + 16)
             return print_error(WRONG_ARGNUM, USAGE_BED);
-        if (!check_file_existence(opt[2]))
-            return print_error(FILE_INACCESSIBLE, 0, opt[2]);
-        if (!check_file_existence(opt[3]))
-            return print_error(FILE_INACCESSIBLE, 0, opt[3]);
-        bool ok[] = {false, false, false, false};
-        for (int i = 5; i < optnum; ++i) {
+        for (int i = 2; i < first - 1; ++i)
+        {
+            if (!check_file_existence(opt[i]))
+                return print_error(FILE_INACCESSIBLE, 0, opt[i]);
+        }
+        vector<bool> ok(optnum - first, false);
+        for (int i = first; i < optnum; ++i) {
             if ((strcmp(opt[i], "--maxgap") == 0) && (optnum > i+1))
             {
-                ok[i-5] = true;
-                ok[i-4] = true;
+                ok[i-first] = true;
+                ok[i-first+1] = true;
                 maxgap = atoi(opt[i+1]);
             }
             if (strcmp(opt[i], "--outer") == 0)
             {
-                ok[i-5] = true;
+                ok[i-first] = true;
                 inner = false;
             }
             if (strcmp(opt[i], "--uncompressed") == 0)
             {
-                ok[i-5] = true;
+                ok[i-first] = true;
                 compressed = false;
             }
             if (strcmp(opt[i], "--alwaysmap") == 0)
             {
-                ok[i-5] = true;
+                ok[i-first] = true;
                 alwaysmap = true;
             }
+            if (strcmp(opt[i], "--sparse") == 0)
+            {
+                ok[i-first] = true;
+                sparse = true;
+            }
+            if (strcmp(opt[i], "--stats") == 0)
+            {
+                ok[i-first] = true;
+                stats = true;
+            }
+            if ((strcmp(opt[i], "--shared-pool") == 0) && (optnum > i+1))
+            {
+                ok[i-first] = true;
+                ok[i-first+1] = true;
+                if (strlen(opt[i+1]) >= NAME_SIZE)
+                {
+                    std::cerr << "Shared pool name is longer than "
+                              << NAME_SIZE - 1 << " characters" << endl;
+                    return false;
+                }
+                strcpy(pool_name, opt[i+1]);
+            }
+            if ((strcmp(opt[i], "--configs") == 0) && (optnum > i+1))
+            {
+                ok[i-first] = true;
+                ok[i-first+1] = true;
+                if (!parse_configs(opt[i+1], configs)) return false;
+            }
+            if ((strcmp(opt[i], "--input") == 0) && (optnum > i+1))
+            {
+                ok[i-first] = true;
+                ok[i-first+1] = true;
+                if (!check_file_existence(opt[i+1]))
+                    return print_error(FILE_INACCESSIBLE, 0, opt[i+1]);
+                strcpy(input_fname, opt[i+1]);
+            }
+            if (strcmp(opt[i], "--binary") == 0)
+            {
+                ok[i-first] = true;
+                binary = true;
+            }
+            if ((strcmp(opt[i], "--threads") == 0) && (optnum > i+1))
+            {
+                ok[i-first] = true;
+                ok[i-first+1] = true;
+                threads = atoi(opt[i+1]);
+                if (threads < 0) return false;
+            }
         }
-        for (int i = 5; i < optnum; ++i)
+        for (int i = first; i < optnum; ++i)
         {
-            if (!ok[i-5]) return false;
+            if (!ok[i-first]) return false;
         }
         strcpy(command, "bed");
         strcpy(file1, opt[2]);
-        strcpy(file2, opt[3]);
-        strcpy(informant, opt[4]);
+        strcpy(file2, opt[first-2]);
+        strcpy(informant, opt[first-1]);
     }
     else if (strcmp(opt[1], "info") == 0)
     {
@@ -126,6 +306,104 @@ bool parse_options(char* opt[], int optnum, char command[], char file1[],
         strcpy(command, "info");
         strcpy(file1, opt[2]);
     }
+    else if ((strcmp(opt[1], "convert") == 0) ||
+             (strcmp(opt[1], "repack") == 0))
+    {
+        if (optnum < 6 || optnum > 8)
+        {
+            return print_error(WRONG_ARGNUM, strcmp(opt[1], "convert") == 0 ?
+                               USAGE_CONVERT : USAGE_REPACK);
+        }
+        if (!check_file_existence(opt[2]))
+            return print_error(FILE_INACCESSIBLE, 0, opt[2]);
+        if (!check_file_existence(opt[3]))
+            return print_error(FILE_INACCESSIBLE, 0, opt[3]);
+        for (int i = 6; i < optnum; ++i)
+        {
+            if (strcmp(opt[i], "--uncompressed") == 0) compressed = false;
+            else if (strcmp(opt[i], "--sharded") == 0) sharded = true;
+            else return false;
+        }
+        strcpy(command, opt[1]);
+        strcpy(file1, opt[2]);
+        strcpy(file2, opt[3]);
+        strcpy(out_file1, opt[4]);
+        strcpy(out_file2, opt[5]);
+    }
+    else if (strcmp(opt[1], "extract") == 0)
+    {
+        if (optnum < 6 || optnum > 7)
+            return print_error(WRONG_ARGNUM, USAGE_EXTRACT);
+        if (!check_file_existence(opt[2]))
+            return print_error(FILE_INACCESSIBLE, 0, opt[2]);
+        if (!check_file_existence(opt[3]))
+            return print_error(FILE_INACCESSIBLE, 0, opt[3]);
+        if (optnum == 7)
+        {
+            if (strcmp(opt[6], "--uncompressed") != 0) return false;
+            compressed = false;
+        }
+        strcpy(command, "extract");
+        strcpy(file1, opt[2]);
+        strcpy(file2, opt[3]);
+        strcpy(informant, opt[4]);
+        strcpy(out_file1, opt[5]);
+    }
+    else if (strcmp(opt[1], "slice") == 0)
+    {
+        if (optnum < 6 || optnum > 14)
+            return print_error(WRONG_ARGNUM, USAGE_SLICE);
+        if (!check_file_existence(opt[2]))
+            return print_error(FILE_INACCESSIBLE, 0, opt[2]);
+        if (!check_file_existence(opt[3]))
+            return print_error(FILE_INACCESSIBLE, 0, opt[3]);
+        for (int i = 6; i < optnum; ++i)
+        {
+            if (strcmp(opt[i], "--uncompressed") == 0) compressed = false;
+            else if (strcmp(opt[i], "--sharded") == 0) sharded = true;
+            else if ((strcmp(opt[i], "--chromosomes") == 0) &&
+                     (optnum > i+1))
+            {
+                split_list(opt[++i], selection.chromosomes);
+            }
+            else if ((strcmp(opt[i], "--informants") == 0) &&
+                     (optnum > i+1))
+            {
+                split_list(opt[++i], selection.informants);
+            }
+            else if ((strcmp(opt[i], "--regions") == 0) && (optnum > i+1))
+            {
+                if (!check_file_existence(opt[++i]))
+                    return print_error(FILE_INACCESSIBLE, 0, opt[i]);
+                strcpy(input_fname, opt[i]);
+            }
+            else return false;
+        }
+        strcpy(command, "slice");
+        strcpy(file1, opt[2]);
+        strcpy(file2, opt[3]);
+        strcpy(out_file1, opt[4]);
+        strcpy(out_file2, opt[5]);
+    }
+    else if (strcmp(opt[1], "add-informant") == 0)
+    {
+        if (optnum < 5 || optnum > 6)
+            return print_error(WRONG_ARGNUM, USAGE_ADD_INFORMANT);
+        for (int i = 2; i < 5; ++i)
+        {
+            if (!check_file_existence(opt[i]))
+                return print_error(FILE_INACCESSIBLE, 0, opt[i]);
+        }
+        if (optnum == 6)
+        {
+            if (strcmp(opt[5], "--uncompressed") != 0) return false;
+            compressed = false;
+        }
+        strcpy(command, "add-informant");
+        strcpy(file1, opt[2]);
+        strcpy(file2, opt[3]);
+        strcpy(pairwise_maf, opt[4]);
+    }
     return true;
 }
 
@@ -140,15 +418,69 @@ void delete_index(map <bioid_t, vector <IndexItem*> > &index)
     }
 }
 
+// Report why a command failed and free the index, return the exit status
+int command_failed(const std::runtime_error &e,
+                   map <bioid_t, vector <IndexItem*> > &index)
+{
+    cerr << e.what() << endl;
+    delete_index(index);
+    return 1;
+}
+
+void delete_mappings(vector<Mapping*> &mappings)
+{
+    for (auto it = mappings.begin(); it != mappings.end(); ++it) delete (*it);
+    mappings.clear();
+}
+
+// Set by SIGUSR1 to print statistics after the current input line
+volatile sig_atomic_t report_requested = 0;
+
+void request_report(int)
+{
+    report_requested = 1;
+}
+
+// Print statistics and memory taken by the mappings of "bed", their shared
+// IOHandler and the whole process at its peak
+void print_report(vector<Mapping*> &mappings, vector<MappingConfig> &configs,
+                  IOHandler &ioh)
+{
+    for (unsigned i = 0; i < mappings.size(); ++i)
+    {
+        mappings[i]->print_stats(configs[i].tag);
+        mappings[i]->print_memory(configs[i].tag);
+    }
+    ioh.print_stats();
+    ioh.print_memory();
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0)
+    {
+        cerr << "Memory: peak resident " << usage.ru_maxrss << " kB"
+             << endl;
+    }
+}
+
 int main(int argc, char* argv[]) {
-    char command[10];
+    char command[20];
     char file1[1000] = "", file2[1000] = "", file3[1000] = "";
-    char informantc[NAME_SIZE] = "";
+    char out_file1[1000] = "", out_file2[1000] = "", pairwise_maf[1000] = "";
+    char input_fname[1000] = "";
+    char informantc[NAME_SIZE] = "", pool_name[NAME_SIZE] = "";
     int maxgap = 10;
-    bool inner = true, alwaysmap = false, compressed = true;
+    bool inner = true, alwaysmap = false, compressed = true, sharded = false;
+    bool sparse = false, stats = false, binary = false;
+    // Threads decoding blocks of a query, 0 for all cores; not given, blocks
+    // are decoded by one and a BGZF input inflated by all
+    int threads = -1;
+    vector<MappingConfig> configs;
+    SliceSelection selection;
+    selection.has_regions = false;
     
-    if (!parse_options(argv, argc, command, file1, file2, file3, informantc,
-        maxgap, inner, alwaysmap, compressed))
+    if (!parse_options(argv, argc, command, file1, file2, file3, out_file1,
+        out_file2, pairwise_maf, informantc, maxgap, inner, alwaysmap,
+        compressed, sharded, sparse, stats, pool_name, configs,
+        input_fname, binary, threads, selection))
     {
         print_error(WRONG_ARGS);
         exit(0);
@@ -179,48 +511,164 @@ int main(int argc, char* argv[]) {
         }
         cout << endl;
     }
+    else if ((strcmp(command, "convert") == 0) ||
+             (strcmp(command, "repack") == 0))
+    {
+        try
+        {
+            ioh.open_to_map();
+            ioh.convert(out_file1, out_file2, genome_map, chr_maps, index,
+                        sharded, strcmp(command, "repack") == 0);
+        }
+        catch (std::runtime_error &e)
+        {
+            return command_failed(e, index);
+        }
+        delete_index(index);
+    }
+    else if (strcmp(command, "extract") == 0)
+    {
+        try
+        {
+            ioh.open_to_map();
+            ioh.extract(out_file1, informant, genome_map, chr_maps, index);
+        }
+        catch (std::runtime_error &e)
+        {
+            return command_failed(e, index);
+        }
+        delete_index(index);
+    }
+    else if (strcmp(command, "slice") == 0)
+    {
+        try
+        {
+            if (input_fname[0] != '\0') read_regions(input_fname, selection);
+            ioh.open_to_map();
+            ioh.slice(out_file1, out_file2, genome_map, chr_maps, index,
+                      selection, sharded);
+        }
+        catch (std::runtime_error &e)
+        {
+            return command_failed(e, index);
+        }
+        delete_index(index);
+    }
+    else if (strcmp(command, "add-informant") == 0)
+    {
+        try
+        {
+            ioh.open_to_map();
+            ioh.add_informant(pairwise_maf, genome_map, chr_maps, index);
+        }
+        catch (std::runtime_error &e)
+        {
+            return command_failed(e, index);
+        }
+        delete_index(index);
+    }
     else if (strcmp(command, "bed") == 0)
     {
+        vector<Mapping*> mappings;
+        BedReader* input = NULL;
+        BinaryWriter* writer = NULL;
         try
         {
             string informant(informantc);
+            if (pool_name[0] != '\0') ioh.attach_shared_pool(pool_name);
+            if (threads >= 0) ioh.set_threads(threads);
             ioh.open_to_map();
-            Mapping to_map(&ioh, informant, maxgap, maxgap, inner, alwaysmap,
-                        &genome_map, &chr_maps, &index);
+            // One Mapping per configuration; they read the same blocks for
+            // a query, so all but the first get them decoded from the cache
+            if (configs.empty())
+            {
+                MappingConfig config = {"", inner, maxgap, alwaysmap};
+                configs.push_back(config);
+            }
+            for (auto it = configs.begin(); it != configs.end(); ++it)
+            {
+                mappings.push_back(new Mapping(&ioh, informant, it->maxgap,
+                                               it->maxgap, it->inner,
+                                               it->alwaysmap, sparse,
+                                               &genome_map, &chr_maps,
+                                               &index));
+                if (!it->tag.empty()) it->tag += "\t";
+            }
+            if (input_fname[0] != '\0')
+                input = new BedReader(input_fname, std::max(threads, 0));
+            if (binary)
+            {
+                writer = new BinaryWriter(cout,
+                                          chr_maps[genome_map[informant]],
+                                          mappings[0]->get_error_names());
+            }
+            signal(SIGUSR1, request_report);
             string bedline;
-            while (true)
+            for (uint64_t line = 0; ; ++line)
             {
+                if (report_requested)
+                {
+                    report_requested = 0;
+                    print_report(mappings, configs, ioh);
+                }
                 // For each BED-line on input:
-                getline(cin, bedline);
-                if (cin.eof()) break;
+                if (input != NULL)
+                {
+                    if (!input->get_line(bedline)) break;
+                }
+                else
+                {
+                    getline(cin, bedline);
+                    if (cin.eof()) break;
+                }
                 if (bedline.compare("") == 0) continue;
                 BedQuery* bedquery = new BedQuery(bedline);
                 // Transform it to closed interval
                 bedquery->to_closed();
-                // Try to map the interval
-                to_map.set_query(bedquery);
-                BedQuery* bq;
-                try
-                {
-                    bq = to_map.get_answer();
-                    bq->to_half_closed();
-                    cerr << bq->get_name() << "\tmapped" << endl;
-                    // If the mapping was successful, print it
-                    cout << bq->get_bedline() << endl;
-                }
-                catch (MappingError e)
+                // Try to map the interval in each configuration
+                for (unsigned i = 0; i < mappings.size(); ++i)
                 {
-                    to_map.print_errors();
+                    Mapping &to_map = *mappings[i];
+                    to_map.set_query(bedquery);
+                    BedQuery* bq;
+                    try
+                    {
+                        bq = to_map.get_answer();
+                        bq->to_half_closed();
+                        cerr << configs[i].tag << bq->get_name()
+                             << "\tmapped" << endl;
+                        // If the mapping was successful, print it
+                        if (writer != NULL) writer->write_answer(line, i, bq);
+                        else
+                            cout << configs[i].tag << bq->get_bedline() << endl;
+                    }
+                    catch (MappingError e)
+                    {
+                        if (writer != NULL)
+                        {
+                            int code = to_map.get_error_code();
+                            writer->write_error(line, i, code > 0 ? code :
+                                                MAPPED_UNKNOWN_ERROR);
+                        }
+                        to_map.print_errors(configs[i].tag);
+                    }
+                    to_map.delete_old();
                 }
-                to_map.delete_old();
                 delete bedquery;
             }
+            if (stats) print_report(mappings, configs, ioh);
         }
         catch (std::runtime_error e)
         {
+            delete writer;
+            delete input;
+            delete_mappings(mappings);
             delete_index(index);
             throw e;
         }
+        delete writer;
+        delete input;
+        delete_mappings(mappings);
         delete_index(index);
     }
 }
\ No newline at end of file